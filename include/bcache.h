@@ -0,0 +1,58 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+/*
+ * Cache of disk blocks, shared by every thread using the disk.
+ *
+ * The cache is set associative: block b can only live in set b % nsets,
+ * each set holds BCACHE_WAYS blocks behind its own lock, and the victim in
+ * a full set is picked with the clock algorithm. Threads working on
+ * different sets never contend.
+ *
+ * The cache is write-back together with wback.c: disk_write_block() hands
+ * the block to wback_add() and then inserts it here, so the cached copy is
+ * the newest one even though the image is only written later by the
+ * flusher (writes to a mounted snapshot view go to its overlay at once
+ * instead). Flushing does not touch the cache, and evicting a block that is
+ * still dirty is harmless because a read miss looks at the dirty set before
+ * the image. disk.c keeps the two coherent: reads fill the cache, writes
+ * update both, a failed write drops the block from the cache, and discards
+ * drop the range from both. The cache does not order a read miss against a
+ * concurrent write of the same block; callers above disk.c must not race on
+ * one block (naivefs.c serializes writers against everyone else).
+ */
+
+#define BCACHE_WAYS 8
+#define BCACHE_MAX_BLOCKS (64 * 1024)   // 32 MiB of block data
+
+/**
+ * @brief Allocate a cache of at least nblocks blocks, but no more than
+ * BCACHE_MAX_BLOCKS. Called by open_disk().
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int bcache_init(unsigned int nblocks);
+
+/**
+ * @brief Drop every block and free the cache. Called by close_disk().
+ */
+void bcache_destroy();
+
+/**
+ * @brief Copy block_num into buf if it is cached.
+ *
+ * @return returns 0 on a hit, -1 on a miss.
+ */
+int bcache_lookup(unsigned int block_num, char* buf);
+
+/**
+ * @brief Cache buf as the content of block_num, replacing any older copy.
+ */
+void bcache_insert(unsigned int block_num, const char* buf);
+
+/**
+ * @brief Drop blocks [block_num, block_num + count) from the cache.
+ */
+void bcache_invalidate(unsigned int block_num, unsigned int count);
+
+#endif
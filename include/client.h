@@ -0,0 +1,44 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+/*
+ * naivefsd 的客户端，协议见 proto.h。
+ * 可以连续调用 nfsc_send 发出多个请求，再用 nfsc_recv 按完成顺序取回响应。
+ * 一个 nfsc_t 只能由一个线程使用。
+ */
+
+#include "naivefs.h"
+#include "proto.h"
+
+typedef struct nfsc nfsc_t;
+
+typedef struct nfsc_reply {
+    uint32_t tag;
+    int32_t result;             // 成功时 >=0，失败时为负的 errno
+    void *data;                 // 响应的附加数据，下一次 nfsc_recv 之前有效
+    uint32_t data_len;
+} nfsc_reply_t;
+
+/**
+ * @brief 连接 socket_path 上的 naivefsd
+ * @return 成功返回连接，失败返回NULL
+ */
+nfsc_t* nfsc_connect(const char *socket_path);
+
+void nfsc_close(nfsc_t *c);
+
+/**
+ * @brief 发送一个请求，不等待响应
+ *        path2 只用于 NFS_OP_COPY，data/count 用于 NFS_OP_WRITE，count 也是 NFS_OP_READ 要读的字节数
+ * @return 成功返回0，失败返回负的错误码
+ */
+int nfsc_send(nfsc_t *c,uint32_t tag,int op,const char *path,const char *path2,
+    nfs_ino_t ino,uint64_t off,const void *data,uint32_t count);
+
+/**
+ * @brief 等待下一个响应
+ * @return 成功返回0，连接断开或出错返回负的错误码
+ */
+int nfsc_recv(nfsc_t *c,nfsc_reply_t *reply);
+
+#endif
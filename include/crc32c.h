@@ -0,0 +1,28 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+/*
+ * CRC32C（Castagnoli 多项式，与 ext4、iSCSI 相同），用于元数据校验。
+ * 首次调用时检测CPU：x86-64 上有 SSE4.2、ARMv8 上有 CRC 扩展时用硬件指令，
+ * 否则用查表法，结果完全相同。
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief 在 crc 的基础上继续计算 buf 的校验和；crc 为0时即计算 buf 本身的校验和
+ */
+uint32_t crc32c(uint32_t crc,const void *buf,size_t len);
+
+/**
+ * @brief 查表法实现，供测试和性能对比
+ */
+uint32_t crc32c_sw(uint32_t crc,const void *buf,size_t len);
+
+/**
+ * @brief crc32c 使用的实现："sse4.2"、"armv8-crc" 或 "table"
+ */
+const char* crc32c_impl(void);
+
+#endif
@@ -4,9 +4,33 @@
 // The size of one single disk block in bytes
 #define DEVICE_BLOCK_SIZE 512
 
+// The file backing the virtual disk
+#define DISK_FILE "disk"
 
-// Total disk size in bytes, 4 * 1024 * 1024 bytes (4 MiB) in total
-int get_disk_size();
+
+// Default size in bytes of a newly created disk, 4 * 1024 * 1024 bytes (4 MiB)
+#define DISK_SIZE (4*1024*1024)
+
+// Largest disk that block numbers (unsigned int) can address
+#define DISK_MAX_SIZE (4294967295ULL * DEVICE_BLOCK_SIZE)
+
+/**
+ * @brief Set the size of the disk file the next open_disk() creates when
+ * the file does not exist yet. 0 selects DISK_SIZE.
+ *
+ * @return returns 0 on success, -1 if size is not between one block and
+ * DISK_MAX_SIZE.
+ *
+ * @note An existing disk file keeps its size.
+ */
+int disk_set_create_size(unsigned long long size);
+
+/**
+ * @brief The number of blocks of the open disk, 0 if no disk is open.
+ *
+ * @note The size is taken from the disk file when it is opened.
+ */
+unsigned int disk_nblocks();
 
 /**
  * @brief Open the virtual disk.
@@ -14,18 +38,49 @@ int get_disk_size();
  * @return returns 0 on success, -1 otherwise. 
  * 
  * @note This function will open a file named "disk" as a vritual disk
- * If the file is not found, it will try to create the file, and fill it with zeros of 4 MiB.
+ * If the file is not found, it will try to create the file as a sparse file of
+ * DISK_SIZE bytes (or what disk_set_create_size() chose), which reads as zeros.
+ * A file larger than DISK_MAX_SIZE is refused.
  * This function must be called before any calls to disk_read_block() and disk_write_block().
  * This function will fail if the disk is already opened.
+ * All snapshots of the disk are opened as well, and if snapshot_use() selected a
+ * snapshot, reads and writes go to that snapshot's view (see snapshot.h).
  */
 int open_disk();
 
+/**
+ * @brief Open the virtual disk backed by the file at path.
+ * 
+ * @return returns 0 on success, -1 otherwise. 
+ * 
+ * @note Same as open_disk(), which opens DISK_FILE. Snapshots of the image are
+ * looked up next to path.
+ */
+int open_disk_file(const char* path);
+
+/**
+ * @brief Ask the next open_disk() to bypass the host page cache (O_DIRECT).
+ * 
+ * @note The block cache keeps the blocks that were read, so the host does not
+ * need to cache the image a second time. If the host file system does not
+ * support direct I/O on the image (tmpfs, devices with sectors larger than
+ * DEVICE_BLOCK_SIZE), the disk is opened for buffered I/O instead;
+ * disk_is_direct() tells which one is in use. Snapshot files always use
+ * buffered I/O.
+ */
+void disk_use_direct(int on);
+
+/**
+ * @brief returns 1 if the open disk does direct I/O, 0 otherwise.
+ */
+int disk_is_direct();
+
 /**
  * @brief Close the virtual disk.
  * 
  * @return returns 0 on success, -1 otherwise. 
  * 
- * @note This function will close the virtual disk file.
+ * @note This function will flush buffered writes and close the virtual disk file.
  * After calling this function, all calls to disk_read_block() and disk_write_block() will fail
  * util open_disk() is called again.
  */
@@ -43,6 +98,27 @@ int close_disk();
  */
 int disk_read_block(unsigned int block_num, char* buf);
 
+/**
+ * @brief Like disk_read_block(), but a block that is not in the block cache
+ * is not added to it.
+ * 
+ * @param cached Set to 1 if the block came from the cache, 0 otherwise.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note For callers that verify a block before trusting it: a cached block
+ * has been verified (or written) already, a block read from the image is
+ * verified first and then handed to disk_fill_block(), so a corrupt block
+ * never gets into the cache.
+ */
+int disk_read_block_nofill(unsigned int block_num, char* buf, int* cached);
+
+/**
+ * @brief Add buf to the block cache as the content of block_num.
+ * 
+ * @note Only for blocks read with disk_read_block_nofill().
+ */
+void disk_fill_block(unsigned int block_num, const char* buf);
+
 /**
  * @brief Write content of buf to the block_num-th block.
  * 
@@ -51,7 +127,55 @@ int disk_read_block(unsigned int block_num, char* buf);
  * @return returns 0 on success, -1 otherwise.
  * 
  * @note Make sure open_disk() is called before calling this function.
+ * On the live view the block is only buffered (see wback.h); reads see the
+ * new content at once, the image gets it at the next flush.
  */
 int disk_write_block(unsigned int block_num, char* buf);
 
+/**
+ * @brief Write every buffered block to the image.
+ * 
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note close_disk() flushes as well. Call this before anything that looks
+ * at the image behind the block layer's back, such as creating a snapshot.
+ */
+int disk_flush();
+
+/**
+ * @brief Read the block_num-th block of the live disk, bypassing the mounted view.
+ * 
+ * @note Used by the snapshot layer; everything else should call disk_read_block().
+ */
+int disk_read_raw(unsigned int block_num, char* buf);
+
+/**
+ * @brief Release the storage behind count blocks starting at block_num.
+ * 
+ * @param block_num The index of the first block to be discarded.
+ * @param count     The number of consecutive blocks.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The range is punched out of the backing file with fallocate(), so the
+ * image stays sparse on the host; the blocks read back as zeros afterwards.
+ * The size of the virtual disk does not change. Fails on hosts or file systems
+ * that do not support hole punching. Blocks still shared with a snapshot are
+ * preserved first; in a snapshot view this function does nothing.
+ */
+int disk_discard_blocks(unsigned int block_num, unsigned int count);
+
+typedef struct disk_stats {
+        unsigned long reads;            // disk_read_block() calls
+        unsigned long cache_hits;       // reads served by the block cache
+        unsigned long writes;           // disk_write_block() calls
+        unsigned long discards;         // blocks passed to disk_discard_blocks()
+        unsigned long flushed;          // blocks written to the image by writeback
+        unsigned long write_ios;        // vectored writes issued by writeback
+} disk_stats_t;
+
+/**
+ * @brief Counters since the process started; safe to call at any time.
+ */
+void disk_get_stats(disk_stats_t* stats);
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+/*
+ * 空闲区间的内存索引：把位图中连续的空闲位记为一个区间（extent），
+ * 同时按起点组织成AVL树、按长度分桶（第 k 个桶存放长度在 [2^k, 2^(k+1)) 的区间）。
+ * 按起点查找相邻区间和按长度查找合适的区间都是对数时间，不再扫描位图。
+ * filesys.c 为数据块和inode各建一个索引，下文以数据块为例。
+ *
+ * 索引可以只覆盖位图的一部分：filesys.c 在分配时按需把位图的一段（一个元数据 disk block）
+ * 加入索引，挂载时不必读入整个位图；挂载和卸载时丢弃。
+ * block_map 仍是唯一的持久化状态，索引由 filesys.c 在每次分配和释放时同步维护。
+ * 只在持有互斥锁时调用（见 naivefs.c）
+ */
+
+#include <stdint.h>
+
+#define EXTENT_NBUCKET 32
+
+typedef struct extent {
+    uint32_t start;
+    uint32_t len;
+    int height;
+    struct extent *left,*right;     // 按 start 排序的AVL树
+    struct extent *prev,*next;      // 同一长度桶中的双向链表
+} extent_t;
+
+typedef struct extent_index {       // 全0即为未建立的空索引
+    extent_t *root;
+    extent_t *buckets[EXTENT_NBUCKET];
+    uint32_t nfree;                 // 索引中的空闲块总数
+    int ready;
+} extent_index_t;
+
+/**
+ * @brief 丢弃索引
+ */
+void extent_reset(extent_index_t *x);
+
+/**
+ * @brief 索引是否有效：加入过位图且此后没有因内存不足被丢弃
+ */
+int extent_ready(extent_index_t *x);
+
+/**
+ * @brief 把块占用位图（MSB在前，置位为占用）中 [first, end) 的空闲块加入索引，
+ *        与已有的相邻区间合并。索引无效时先清空
+ * @return 成功返回0,内存不足返回-ENOMEM（此时索引被丢弃）
+ */
+int extent_add_map(extent_index_t *x,const uint32_t *map,uint32_t first,uint32_t end);
+
+/**
+ * @brief 分配 n 个数据块，块号依次写入 blocks：
+ *        goal 不为0时优先从 goal 开始连续分配（用于追加写紧接在文件最后一块之后），
+ *        其余部分选取能容纳它的最小长度桶中的区间，都放不下时从最长的区间开始依次取用
+ * @return 成功返回0，空闲块不足返回-ENOSPC（此时不做任何分配），内存不足返回-ENOMEM
+ */
+int extent_alloc(extent_index_t *x,uint32_t goal,uint32_t n,uint32_t *blocks);
+
+/**
+ * @brief 归还从 start 开始的 n 个块，与相邻的空闲区间合并
+ * @return 成功返回0,内存不足返回-ENOMEM
+ */
+int extent_free(extent_index_t *x,uint32_t start,uint32_t n);
+
+#endif
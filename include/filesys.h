@@ -1,17 +1,27 @@
 #ifndef _FILESYS_H
 #define _FILESYS_H
 
+#include <stdint.h>
 #include "util.h"
 
+/*
+ * super block 只占 block 0 的第一个 disk block，记录几何参数和计数，
+ * 各区域的位置由 nblocks 和 ninodes 算出（见 layout.h）
+ */
 typedef struct super_block {
     int32_t magic_num;          // 幻数
-    int32_t free_block_count;   // 空闲数据块数       
+    uint32_t block_size;        // 数据块大小，与编译时的 BLOCK_SIZE 不同时拒绝挂载
+    uint32_t nblocks;           // 数据块总数（含元数据）
+    uint32_t ninodes;           // inode总数
+    int32_t free_block_count;   // 空闲数据块数
     int32_t free_inode_count;   // 空闲inode数
     int32_t dir_inode_count;    // 目录inode数
-    uint32_t block_map[128];    // 数据块占用位图
-    uint32_t inode_map[32];     // inode占用位图
+    uint32_t features;          // SP_FEATURE_*
+    uint32_t checksum;          // 开启 SP_FEATURE_CSUM 时为 super block 的 CRC32C，计算时跳过本字段
 } sp_block_t;
 
+#define SP_FEATURE_CSUM 0x1     // 元数据校验：super block、元数据数组、inode表和目录块
+
 typedef struct inode {
     uint32_t size;              // 文件大小
     uint16_t file_type;         // 文件类型（文件/文件夹）
@@ -19,48 +29,124 @@ typedef struct inode {
     uint32_t block_point[6];    // 数据块指针
 } inode_t;
 
-typedef struct dir_item {               // 目录项一个更常见的叫法是 dirent(directory entry)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size does not match the layout");
+_Static_assert(sizeof(sp_block_t) <= DEVICE_BLOCK_SIZE, "super block does not fit in one disk block");
+_Static_assert(BLOCK_SIZE % DEVICE_BLOCK_SIZE == 0 && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+    "block size must be a power of two multiple of the device block size");
+_Static_assert(BLOCK_SIZE <= 32768, "dir_item_t.rec_len is 16 bits");
+
+/*
+ * 目录项一个更常见的叫法是 dirent(directory entry)
+ * 采用 ext2 风格的变长记录：一个目录块被若干条记录首尾相接地铺满，
+ * rec_len 指向下一条记录，最后一条记录的 rec_len 延伸到块尾。
+ * name_len 为 0 的记录是空闲记录（只可能出现在块首）。
+ */
+typedef struct dir_item {
     uint32_t inode_id;          // 当前目录项表示的文件/目录的对应inode
-    uint16_t valid;             // 当前目录项是否有效 
+    uint16_t rec_len;           // 本条记录的长度（含名字和对齐填充）
+    uint8_t name_len;           // 名字长度，不含'\0'，为0表示空闲记录
     uint8_t type;               // 当前目录项类型（文件/目录）
-    char name[121];             // 目录项表示的文件/目录的文件名/目录名
+    char name[];                // 文件名/目录名，不以'\0'结尾
 } dir_item_t;
 
 
-typedef struct p_stack {                            // 路径栈
-    struct dir_item dir_stack[MAXARGS];     // 元素为dir_item
-    int top;                                // 栈顶指针
-} p_stack_t;
+/*
+ * 开启元数据校验时，每个目录块的最后 DIR_TAIL_SIZE 字节是 dir_tail_t，
+ * 目录项只铺满它之前的 dir_block_size() 字节。
+ * 校验和覆盖目录块中 dir_tail_t 之前的部分，并以块号为种子，写错位置的块也能发现。
+ */
+typedef struct dir_tail {
+    uint32_t inode_id;          // 0
+    uint16_t rec_len;           // DIR_TAIL_SIZE
+    uint8_t name_len;           // 0
+    uint8_t type;               // DIR_TAIL_TYPE
+    uint32_t csum;
+} dir_tail_t;
+
+#define DIR_TAIL_SIZE 12
+#define DIR_TAIL_TYPE 0xde
+
+_Static_assert(sizeof(dir_tail_t) == DIR_TAIL_SIZE, "dir tail size");
+
+/*
+ * 以下为供 walk.c / tree.c / naivefs.c 使用的内部接口，实现见 filesys.c
+ * load_* / store_* 及 dir_block_* 不使用全局缓冲，可多线程调用；
+ * 其余函数会修改全局缓冲或 super block，只能在主线程调用
+ */
+int load_block(uint32_t block_id,char *buf);
+int store_block(uint32_t block_id,char *buf);
+int load_dir_block(uint32_t block_id,char *buf);
+int store_dir_block(uint32_t block_id,char *buf);
+int load_inodes(uint32_t *ids,int n,inode_t *out);
+int store_inodes(uint32_t *ids,int n,inode_t *inodes);
+int inode_nblock(inode_t *inode);
+
+int dir_block_size();
+void dir_block_init(char *block);
+int dir_block_insert(char *block,const char *name,uint32_t inode_id,uint8_t type);
 
 /**
- * @brief 初始化文件系统
+ * @brief 逐个分量解析 path，路径的长度和深度不限，只有每个分量不能超过 DIR_NAME_MAX
+ *        返回最后一个分量所在目录的inode号，最后一个分量存入 tmp（至少 DIR_NAME_MAX+1 字节）
  */
-int init_filesystem();
-
-int shutdown_filesys();
+int find_path_directory(const char *path,char *tmp);
+int find_path(const char *path,uint8_t *type);
+int dir_lookup(uint32_t dir_id,const char *name,uint8_t *type);
+int dir_add_entry(uint32_t dir_id,const char *name,uint32_t inode_id,uint8_t type);
+int dir_remove_entry(uint32_t dir_id,const char *name);
+int dir_iterate(uint32_t dir_id,int (*fn)(dir_item_t *item,void *arg),void *arg);
+int dir_is_empty(uint32_t dir_id);
+int add_link(uint32_t inode_id,int delta);
+int create_entry(const char *path,uint8_t type);
+int file_read(uint32_t inode_id,char *buf,uint32_t len,uint32_t off);
+int file_write(uint32_t inode_id,const char *buf,uint32_t len,uint32_t off);
+int take_snapshot(const char *name);
+
+int inode_in_use(uint32_t inode_id);
+int alloc_inodes_and_blocks(int ninode,uint32_t *inodes,int nblock,uint32_t *blocks,int ndir);
+int free_inodes_and_blocks(int ninode,uint32_t *inodes,int nblock,uint32_t *blocks,int ndir);
+void discard_blocks(uint32_t *blocks,int nblock);
 
 /**
- * @brief 执行 ls 展示读取文件夹内容
+ * @brief 设置释放数据块时是否在宿主的 disk 文件中打洞，
+ *        类似 ext4 的 discard 挂载选项，默认关闭
  */
-int exec_ls(char *argv[],int argc);
-
+void set_discard(int on);
 
 /**
- * @brief 执行 mkdir 创建文件夹
+ * @brief 设置格式化时是否开启元数据校验（SP_FEATURE_CSUM），默认关闭；
+ *        已有的 image 按其 super block 中的设置挂载
  */
-int exec_mkdir(char *argv[],int argc);
+void set_format_csum(int on);
 
 /**
- * @brief 执行 touch 创建文件
+ * @brief 设置格式化新 image 时的大小（字节，只在创建 image 文件时生效）和inode数，
+ *        为0时分别使用 DISK_SIZE 和每 BYTES_PER_INODE 字节一个inode；已有的 image 按其 super block 挂载
  */
-int exec_touch(char *argv[],int argc);
+void set_format(uint64_t size,uint64_t ninodes);
 
 /**
- * @brief 执行 cp 复制文件
+ * @brief 把操作中对 super block 和元数据数组的修改（write_spblock 只做标记）写进disk，
+ *        只写被修改过的 disk block，开启元数据校验时同时更新校验和。每个操作结束时调用
+ * @return 成功返回0,失败返回-1
  */
-int exec_cp(char *argv[],int argc);
+int sync_spblock();
 
+/**
+ * @brief 是否还有没写进disk的 super block 或元数据数组修改，只在上次 sync_spblock 失败时为真
+ */
+int spblock_pending();
 
+/**
+ * @brief 挂载 image 处的文件系统，image 不是本文件系统时将其格式化
+ * @return 成功返回0,失败返回负的错误码
+ */
+int init_filesystem(const char *image);
 
+/**
+ * @brief 卸载文件系统
+ * @return 成功返回0,失败返回负的错误码
+ */
+int shutdown_filesys();
 
-#endif
\ No newline at end of file
+#endif
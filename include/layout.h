@@ -0,0 +1,100 @@
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+/*
+ * 磁盘布局：image 的块数和inode数在格式化时决定并记录在 super block 中，
+ * 挂载时由它们算出各区域的位置存入 fs_layout，其他文件中不再出现布局相关的字面量。
+ * 数据块大小在编译时选择（CMake 选项 NAIVEFS_BLOCK_SIZE，默认 1024，可取 4096 与主机页对齐），
+ * 各常量都是2的幂，块内地址计算会被编译器折叠为移位和掩码。
+ *
+ * 以数据块为单位，image 依次为：
+ *   0                                  super block
+ *   [bmap_start, imap_start)           块占用位图，覆盖全部 nblocks 个块
+ *   [imap_start, itinit_start)         inode占用位图
+ *   [itinit_start, icsum_start)        已初始化的inode表块
+ *   [icsum_start, itable_start)        inode表每个 disk block 的校验和
+ *   [itable_start, root_block)         inode 表
+ *   root_block                         根目录的第一个目录块
+ *   [n_meta_block, nblocks)            数据块
+ * 以上元数据在格式化时即在块占用位图中标为占用。
+ * 位图和校验和表统称元数据数组，每个 disk block 存放 META_WORDS_PER_DISKBLOCK 个 uint32，
+ * 最后一个 uint32 是该 disk block 的校验和（开启元数据校验时有效）。
+ * 各元数据数组的初值都是全0，格式化时只写有非0内容的 disk block；从未写过的 disk block
+ * 读出为全0（连同校验和），视为内容全为0的有效块。
+ */
+
+#include "disk.h"
+
+#ifndef NAIVEFS_BLOCK_SIZE
+#define NAIVEFS_BLOCK_SIZE 1024
+#endif
+
+#define BLOCK_SIZE NAIVEFS_BLOCK_SIZE   // 每块 BLOCK 的大小
+#define INODE_SIZE 32                   // 每个 INODE 的大小 32Bytes
+#define MAX_INODE_NUM 0x7fffffff        // inode号以 int 返回，目录项中为 uint32
+
+#define NDISKBLOCK_PER_DATABLOCK (BLOCK_SIZE / DEVICE_BLOCK_SIZE)
+#define INODES_PER_DISKBLOCK (DEVICE_BLOCK_SIZE / INODE_SIZE)
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define META_WORDS_PER_DISKBLOCK (DEVICE_BLOCK_SIZE / 4 - 1)
+
+#define BYTES_PER_INODE 4096            // 格式化时默认每 4KiB 空间一个inode
+
+typedef struct layout {
+    uint32_t nblocks;                   // 数据块总数（含元数据）
+    uint32_t ninodes;                   // inode总数，为 INODES_PER_BLOCK 的整数倍
+    uint32_t n_inode_block;             // inode 表的块数
+    uint32_t bmap_start;
+    uint32_t imap_start;
+    uint32_t itinit_start;
+    uint32_t icsum_start;
+    uint32_t itable_start;
+    uint32_t root_block;
+    uint32_t n_meta_block;              // 元数据（含根目录块）占用的块数
+} layout_t;
+
+extern layout_t fs_layout;              // 挂载的文件系统的布局，见 filesys.c
+
+/**
+ * @brief 保存 nbits 位的位图需要的 uint32 个数
+ */
+static inline uint32_t bitmap_words(uint32_t nbits){
+    return nbits / 32 + (nbits % 32 != 0);
+}
+
+/**
+ * @brief 保存 nwords 个 uint32 的元数据数组占用的 disk block 数
+ */
+static inline uint32_t meta_disk_blocks(uint32_t nwords){
+    return (nwords + META_WORDS_PER_DISKBLOCK - 1) / META_WORDS_PER_DISKBLOCK;
+}
+
+/**
+ * @brief inode_id 所在的 disk block
+ */
+static inline uint32_t inode_disk_block(uint32_t inode_id){
+    return fs_layout.itable_start * NDISKBLOCK_PER_DATABLOCK + inode_id / INODES_PER_DISKBLOCK;
+}
+
+/**
+ * @brief inode_id 在其 disk block 中的字节偏移
+ */
+static inline uint32_t inode_disk_offset(uint32_t inode_id){
+    return inode_id % INODES_PER_DISKBLOCK * INODE_SIZE;
+}
+
+/**
+ * @brief disk block disk_id（须为inode表块）中第一个inode的inode_id
+ */
+static inline uint32_t disk_block_first_inode(uint32_t disk_id){
+    return (disk_id - fs_layout.itable_start * NDISKBLOCK_PER_DATABLOCK) * INODES_PER_DISKBLOCK;
+}
+
+/**
+ * @brief 数据块 block_id 的第一个 disk block
+ */
+static inline uint32_t block_disk_block(uint32_t block_id){
+    return block_id * NDISKBLOCK_PER_DATABLOCK;
+}
+
+#endif
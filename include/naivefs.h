@@ -0,0 +1,202 @@
+#ifndef _NAIVEFS_H
+#define _NAIVEFS_H
+
+/*
+ * naivefs 的对外接口，可以静态或动态链接到其他程序中直接调用。
+ * 同一时刻只能挂载一个文件系统；所有函数都可以多线程调用，
+ * 只读的接口（lookup/stat/read/readdir/walk/snapshot_list）可以并发执行，其余接口互斥执行。
+ * 失败时返回负的 errno（如 -ENOENT），可用 nfs_strerror 转为字符串，
+ * 任何函数都不会打印信息或退出进程。
+ * 回调函数在内部锁释放之后调用，回调中可以再调用本接口；回调返回非0时停止遍历，
+ * 该值作为函数的返回值。
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define NFS_API __attribute__((visibility("default")))
+#else
+#define NFS_API
+#endif
+
+typedef uint32_t nfs_ino_t;
+
+#define NFS_TYPE_FILE 0
+#define NFS_TYPE_DIR 1
+
+#define NFS_NAME_MAX 255
+
+#define NFS_MOUNT_DISCARD 0x1       // 释放的块在宿主的 disk 文件中打洞
+#define NFS_MOUNT_DIRECT 0x2        // 绕过宿主的页缓存（O_DIRECT），宿主不支持时退回普通I/O
+#define NFS_MOUNT_CSUM 0x4          // 格式化新 image 时开启元数据校验（CRC32C），校验和不符的块读取时返回-EIO
+
+typedef struct nfs_stat {
+    nfs_ino_t ino;
+    uint32_t type;              // NFS_TYPE_FILE / NFS_TYPE_DIR
+    uint32_t link;              // 连接数
+    uint64_t size;              // 文件大小（字节）
+    uint32_t blocks;            // 占用的数据块数
+    uint32_t block_size;        // 数据块大小（字节）
+} nfs_stat_t;
+
+typedef struct nfs_dirent {
+    nfs_ino_t ino;
+    uint32_t type;
+    char name[NFS_NAME_MAX + 1];
+} nfs_dirent_t;
+
+typedef int (*nfs_readdir_fn)(const nfs_dirent_t *ent,void *arg);
+typedef int (*nfs_readdir_stat_fn)(const nfs_dirent_t *ent,const nfs_stat_t *st,void *arg);
+// total_blocks 为以 path 为根的子树占用的数据块总数
+typedef int (*nfs_walk_fn)(const char *path,const nfs_stat_t *st,uint64_t total_blocks,void *arg);
+// size 为快照已复制的字节数，mounted 表示该快照是否为当前挂载的视图
+typedef int (*nfs_snapshot_fn)(const char *name,uint64_t size,int mounted,void *arg);
+
+/**
+ * @brief 设置之后的 nfs_mount 格式化新 image 时使用的参数，为0时使用默认值：
+ *        size   新建 image 文件的大小（字节），默认 4MiB，最大 2TiB；已存在的 image 文件保持原大小
+ *        inodes inode总数，默认每 4KiB 空间一个，向上取整到整块inode表，最多 2^31-1 个
+ *        已格式化的 image 按其 super block 中记录的参数挂载
+ */
+NFS_API void nfs_set_format(uint64_t size,uint64_t inodes);
+
+/**
+ * @brief 挂载 image（为NULL时使用 "disk"），image 不存在或不是本文件系统时将其格式化
+ *        snapshot 不为NULL时挂载该快照的视图
+ * @return 成功返回0，已有文件系统挂载时返回-EBUSY，super block 或位图校验和不符时返回-EUCLEAN，
+ *         nfs_set_format 的参数放不下元数据或块大小与 image 不符时返回-EINVAL，
+ *         image 为旧格式时返回-ENOTSUP（不会被格式化）
+ */
+NFS_API int nfs_mount(const char *image,const char *snapshot,int flags);
+
+/**
+ * @brief 卸载当前的文件系统
+ */
+NFS_API int nfs_unmount(void);
+
+/**
+ * @brief 查找 path 对应的inode号
+ */
+NFS_API int nfs_lookup(const char *path,nfs_ino_t *ino);
+
+/**
+ * @brief 读取 path 的属性
+ */
+NFS_API int nfs_stat(const char *path,nfs_stat_t *st);
+
+/**
+ * @brief 创建目录
+ */
+NFS_API int nfs_mkdir(const char *path);
+
+/**
+ * @brief 创建空文件，ino 不为NULL时返回新文件的inode号
+ */
+NFS_API int nfs_create(const char *path,nfs_ino_t *ino);
+
+/**
+ * @brief 读文件 ino 从 off 开始的至多 len 字节
+ * @return 成功返回读到的字节数，到达文件尾时返回0
+ */
+NFS_API ssize_t nfs_read(nfs_ino_t ino,void *buf,size_t len,uint64_t off);
+
+/**
+ * @brief 从 off 开始写文件 ino，必要时扩展文件，文件尾与 off 之间补0
+ * @return 成功返回写入的字节数，超出最大文件长度返回-EFBIG
+ */
+NFS_API ssize_t nfs_write(nfs_ino_t ino,const void *buf,size_t len,uint64_t off);
+
+/**
+ * @brief 依次对目录 path 中的每一项（含 "." 和 ".."）调用 fn
+ */
+NFS_API int nfs_readdir(const char *path,nfs_readdir_fn fn,void *arg);
+
+/**
+ * @brief 同 nfs_readdir，同时给出每一项的属性（如 ls -l）
+ *        所有项的inode一次读出：按inode表块分组、按物理顺序读，每个表块只读一次
+ */
+NFS_API int nfs_readdir_stat(const char *path,nfs_readdir_stat_fn fn,void *arg);
+
+/**
+ * @brief 删除文件
+ */
+NFS_API int nfs_unlink(const char *path);
+
+/**
+ * @brief 删除空目录
+ */
+NFS_API int nfs_rmdir(const char *path);
+
+/**
+ * @brief 删除文件或整棵目录树
+ */
+NFS_API int nfs_remove_tree(const char *path);
+
+/**
+ * @brief 将文件或整棵目录树 src 复制为 dst
+ */
+NFS_API int nfs_copy(const char *src,const char *dst);
+
+/**
+ * @brief 按路径字典序对以 path 为根的子树中的每一项（含 path 本身）调用 fn
+ */
+NFS_API int nfs_walk(const char *path,nfs_walk_fn fn,void *arg);
+
+/**
+ * @brief 创建、删除、列出快照，见 snapshot.h
+ */
+NFS_API int nfs_snapshot_create(const char *name);
+NFS_API int nfs_snapshot_delete(const char *name);
+NFS_API int nfs_snapshot_list(nfs_snapshot_fn fn,void *arg);
+
+/**
+ * @brief 把缓冲的写全部写入 image。写操作返回时数据可能还在缓冲中，
+ *        之后最多 100ms 内、卸载时或调用本函数时写入 image
+ */
+NFS_API int nfs_sync(void);
+
+/**
+ * @brief 开始把之后的每次调用（时间戳、参数和结果）记录到 path，格式见 trace.h
+ *        记录文件可以用 replay 工具重放
+ */
+NFS_API int nfs_trace_start(const char *path);
+
+/**
+ * @brief 结束记录
+ */
+NFS_API int nfs_trace_stop(void);
+
+/**
+ * @brief 正在记录时，追加一条说明（如 shell 的命令行），重放时跳过
+ */
+NFS_API void nfs_trace_note(const char *text);
+
+typedef struct nfs_iostat {     // 进程启动以来的累计值，单位为 disk block
+    uint64_t block_reads;       // 读块次数（含块缓存命中）
+    uint64_t block_cache_hits;  // 块缓存命中次数
+    uint64_t block_writes;      // 写块次数
+    uint64_t block_discards;    // 打洞释放的块数
+    uint64_t block_flushes;     // 经写回实际写入 image 的块数（同一块的多次写合并为一次）
+    uint64_t write_ios;         // 写回发出的写请求数（相邻的块合并为一次）
+} nfs_iostat_t;
+
+/**
+ * @brief 读取块I/O计数
+ */
+NFS_API void nfs_iostat(nfs_iostat_t *st);
+
+/**
+ * @brief 错误码 err（负数）对应的说明
+ */
+NFS_API const char* nfs_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
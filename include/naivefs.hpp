@@ -0,0 +1,121 @@
+#ifndef _NAIVEFS_HPP
+#define _NAIVEFS_HPP
+
+/*
+ * naivefs.h 的 C++ 封装：构造时挂载，析构时卸载，
+ * 失败时抛出 std::system_error（错误码为 errno）
+ */
+
+#include "naivefs.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <system_error>
+
+namespace naivefs {
+
+class FileSystem {
+public:
+    explicit FileSystem(const std::string &image = "disk",const char *snapshot = nullptr,int flags = 0){
+        check(nfs_mount(image.c_str(),snapshot,flags),"mount " + image);
+    }
+
+    ~FileSystem(){
+        nfs_unmount();
+    }
+
+    FileSystem(const FileSystem &) = delete;
+    FileSystem& operator=(const FileSystem &) = delete;
+
+    nfs_ino_t lookup(const std::string &path) const {
+        nfs_ino_t ino;
+        check(nfs_lookup(path.c_str(),&ino),path);
+        return ino;
+    }
+
+    nfs_stat_t stat(const std::string &path) const {
+        nfs_stat_t st;
+        check(nfs_stat(path.c_str(),&st),path);
+        return st;
+    }
+
+    void mkdir(const std::string &path){
+        check(nfs_mkdir(path.c_str()),path);
+    }
+
+    nfs_ino_t create(const std::string &path){
+        nfs_ino_t ino;
+        check(nfs_create(path.c_str(),&ino),path);
+        return ino;
+    }
+
+    size_t read(nfs_ino_t ino,void *buf,size_t len,uint64_t off = 0) const {
+        return check(nfs_read(ino,buf,len,off),"read");
+    }
+
+    size_t write(nfs_ino_t ino,const void *buf,size_t len,uint64_t off = 0){
+        return check(nfs_write(ino,buf,len,off),"write");
+    }
+
+    std::vector<nfs_dirent_t> readdir(const std::string &path) const {
+        std::vector<nfs_dirent_t> ents;
+        check(nfs_readdir(path.c_str(),collect,&ents),path);
+        return ents;
+    }
+
+    std::vector<std::pair<nfs_dirent_t,nfs_stat_t>> readdir_stat(const std::string &path) const {
+        std::vector<std::pair<nfs_dirent_t,nfs_stat_t>> ents;
+        check(nfs_readdir_stat(path.c_str(),collect_stat,&ents),path);
+        return ents;
+    }
+
+    void unlink(const std::string &path){
+        check(nfs_unlink(path.c_str()),path);
+    }
+
+    void rmdir(const std::string &path){
+        check(nfs_rmdir(path.c_str()),path);
+    }
+
+    void remove_tree(const std::string &path){
+        check(nfs_remove_tree(path.c_str()),path);
+    }
+
+    void copy(const std::string &src,const std::string &dst){
+        check(nfs_copy(src.c_str(),dst.c_str()),src);
+    }
+
+    void snapshot_create(const std::string &name){
+        check(nfs_snapshot_create(name.c_str()),name);
+    }
+
+    void snapshot_delete(const std::string &name){
+        check(nfs_snapshot_delete(name.c_str()),name);
+    }
+
+    void sync(){
+        check(nfs_sync(),"sync");
+    }
+
+private:
+    static ssize_t check(ssize_t r,const std::string &what){
+        if(r<0){
+            throw std::system_error((int)-r,std::generic_category(),what);
+        }
+        return r;
+    }
+
+    static int collect(const nfs_dirent_t *ent,void *arg){
+        static_cast<std::vector<nfs_dirent_t>*>(arg)->push_back(*ent);
+        return 0;
+    }
+
+    static int collect_stat(const nfs_dirent_t *ent,const nfs_stat_t *st,void *arg){
+        static_cast<std::vector<std::pair<nfs_dirent_t,nfs_stat_t>>*>(arg)->emplace_back(*ent,*st);
+        return 0;
+    }
+};
+
+}
+
+#endif
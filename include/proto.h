@@ -0,0 +1,62 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+/*
+ * naivefsd 与客户端之间的二进制协议，只用于本机的 Unix domain socket，
+ * 所有整数均为本机字节序。
+ *
+ * 客户端发送请求帧：nfs_req_t 头部之后依次是 path_len 字节的路径（不含'\0'），
+ * 以及其余的附加数据：COPY 为目标路径，WRITE 为要写入的数据。
+ * 服务端对每个请求回复一个响应帧：nfs_resp_t 头部之后是附加数据：
+ *   READ    读到的数据
+ *   STAT    一个 nfs_stat_t
+ *   READDIR 若干条 nfs_wire_dirent_t，每条后紧跟 name_len 字节的名字
+ * 客户端可以连续发送多个请求而不等待响应，服务端并发执行，
+ * 响应按完成顺序返回，用 tag 与请求对应。
+ */
+
+#include <stdint.h>
+
+#define NFS_PROTO_MAX_FRAME (64*1024)   // 请求帧和响应帧的最大长度
+
+enum nfs_op {
+    NFS_OP_LOOKUP = 1,          // result 为inode号
+    NFS_OP_STAT,
+    NFS_OP_MKDIR,
+    NFS_OP_CREATE,              // result 为新文件的inode号
+    NFS_OP_READ,                // 读 ino 从 off 开始的 count 字节，result 为读到的字节数
+    NFS_OP_WRITE,               // 从 off 开始写 ino，result 为写入的字节数
+    NFS_OP_READDIR,
+    NFS_OP_UNLINK,
+    NFS_OP_RMDIR,
+    NFS_OP_REMOVE_TREE,
+    NFS_OP_COPY,
+    NFS_OP_SNAPSHOT_CREATE,     // 路径字段为快照名
+    NFS_OP_SNAPSHOT_DELETE,
+};
+
+typedef struct nfs_req {
+    uint32_t len;               // 整帧长度，含头部
+    uint32_t tag;               // 由客户端选择，原样出现在响应中
+    uint64_t off;
+    uint32_t ino;
+    uint32_t count;
+    uint16_t op;
+    uint16_t path_len;
+    uint32_t reserved;
+} nfs_req_t;
+
+typedef struct nfs_resp {
+    uint32_t len;               // 整帧长度，含头部
+    uint32_t tag;
+    int32_t result;             // 成功时 >=0，失败时为负的 errno
+    uint32_t reserved;
+} nfs_resp_t;
+
+typedef struct nfs_wire_dirent {
+    uint32_t ino;
+    uint8_t type;
+    uint8_t name_len;
+} __attribute__((packed)) nfs_wire_dirent_t;
+
+#endif
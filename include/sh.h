@@ -4,11 +4,12 @@
 #include "util.h"
 
 /**
- * @brief 运行shell
+ * @brief 挂载 disk 并运行shell
  * 
- * @param 
+ * @param snapshot 要挂载的快照，NULL 表示挂载当前的 disk
+ * @param flags    nfs_mount 的挂载选项
  */
-void run_shell();
+void run_shell(const char *snapshot,int flags);
 
 
 #endif
@@ -0,0 +1,106 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Copy-on-write snapshots of the virtual disk.
+ *
+ * A snapshot named N of the image "disk" lives in the file "disk.snap.N":
+ * a header, the frozen block map (one bit per disk block: set if the block
+ * was in use when the snapshot was taken), the overlay block map (disk
+ * block -> slot in the snapshot file) and the slots themselves.
+ *
+ * The live view keeps writing the image in place. Before a block that is
+ * in a snapshot's frozen map is overwritten for the first time, its old
+ * contents are copied into a new slot of that snapshot and recorded in its
+ * overlay map. Creating a snapshot therefore only writes metadata, and a
+ * snapshot only grows with the blocks that changed since.
+ *
+ * Mounting a snapshot view reads a block from the snapshot's slot when the
+ * overlay map has one and from the image otherwise. Writes in a snapshot
+ * view go to the snapshot's own slots and never touch the image.
+ *
+ * Opening the disk reads only the header of each snapshot. Both maps are
+ * read in a chunk at a time when a block in the chunk is first looked up,
+ * so mounting does not depend on the size of the disk.
+ */
+
+#define SNAPSHOT_NAME_MAX 32
+#define MAX_SNAPSHOTS 16
+
+/**
+ * @brief Choose which view open_disk() mounts.
+ *
+ * @param name The snapshot to mount, or NULL for the live view.
+ * @return returns 0 on success, -1 if the name is invalid.
+ *
+ * @note Must be called before open_disk(); open_disk() fails if the
+ * snapshot does not exist.
+ */
+int snapshot_use(const char* name);
+
+/**
+ * @brief The name of the mounted snapshot, or NULL when the live view is mounted.
+ */
+const char* snapshot_view();
+
+/**
+ * @brief Open every snapshot of the image at path. Called by open_disk().
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int snapshot_open(const char* path);
+
+/**
+ * @brief Close every snapshot. Called by close_disk().
+ */
+void snapshot_close();
+
+/**
+ * @brief Take a snapshot of the live view.
+ *
+ * @param name   The name of the new snapshot.
+ * @param shared The frozen block map, one bit per disk block (MSB first).
+ * @return returns 0 on success, -1 otherwise.
+ *
+ * @note Fails if a snapshot view is mounted, if the name is taken or if
+ * MAX_SNAPSHOTS snapshots already exist.
+ */
+int snapshot_create(const char* name, const unsigned char* shared);
+
+/**
+ * @brief Delete a snapshot and its file. The mounted snapshot cannot be deleted.
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int snapshot_delete(const char* name);
+
+/**
+ * @brief Copy the names of up to max snapshots into names.
+ *
+ * @return returns the number of snapshots.
+ */
+int snapshot_list(char names[][SNAPSHOT_NAME_MAX + 1], int max);
+
+/**
+ * @brief Number of blocks copied into the named snapshot so far, or -1.
+ */
+int snapshot_size(const char* name);
+
+/**
+ * @brief Preserve blocks [block_num, block_num + count) in every snapshot
+ * that still shares them with the live view. Called by disk.c before the
+ * image is modified.
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int snapshot_preserve(unsigned int block_num, unsigned int count);
+
+/**
+ * @brief Read or write a block of the mounted snapshot view.
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int snapshot_read_block(unsigned int block_num, char* buf);
+int snapshot_write_block(unsigned int block_num, char* buf);
+
+#endif
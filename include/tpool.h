@@ -0,0 +1,70 @@
+#ifndef _TPOOL_H
+#define _TPOOL_H
+
+/*
+ * 工作窃取线程池：每个工作线程有一个自己的双端队列，
+ * 任务中提交的子任务压入本线程队列底部，本线程从底部取（LIFO，局部性好），
+ * 空闲线程从其他线程队列的顶部偷取（FIFO，偷到的往往是较大的子树）。
+ */
+
+#include <pthread.h>
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct tpool tpool_t;
+
+/*
+ * 任务组：记录一组任务（包括它们派生的子任务）中尚未执行完的个数。
+ * 多个操作共用默认线程池时，各自只等待自己组内的任务，互不牵连
+ */
+typedef struct tpool_group {
+    int pending;                    // 组内已提交但尚未执行完的任务数
+    pthread_mutex_t lock;
+    pthread_cond_t done;            // pending 变为0
+} tpool_group_t;
+
+/**
+ * @brief 创建线程池
+ * @param nthreads 工作线程数，<=0 时取在线 CPU 数
+ * @return 成功返回线程池指针，失败返回NULL
+ */
+tpool_t* tpool_create(int nthreads);
+
+/**
+ * @brief 提交一个任务；可在任务内部调用以派生子任务
+ * @return 成功返回0,失败返回-1
+ */
+int tpool_submit(tpool_t *pool,task_fn fn,void *arg);
+
+/**
+ * @brief 提交一个属于任务组 group 的任务，group 为NULL时同 tpool_submit
+ * @return 成功返回0,失败返回-1
+ */
+int tpool_submit_group(tpool_t *pool,tpool_group_t *group,task_fn fn,void *arg);
+
+void tpool_group_init(tpool_group_t *group);
+void tpool_group_destroy(tpool_group_t *group);
+
+/**
+ * @brief 等待 group 中的任务全部执行完毕。
+ *        调用者本身是 pool 的工作线程时，等待期间帮忙执行队列中的任务，不会因占着线程而死锁
+ */
+void tpool_group_wait(tpool_t *pool,tpool_group_t *group);
+
+/**
+ * @brief 获取进程共享的默认线程池，首次调用时按 CPU 数创建
+ * @return 成功返回线程池指针，失败返回NULL
+ */
+tpool_t* tpool_default();
+
+/**
+ * @brief 等待所有已提交的任务（包括它们派生的子任务）执行完毕
+ */
+void tpool_wait(tpool_t *pool);
+
+/**
+ * @brief 等待任务执行完毕后销毁线程池
+ */
+void tpool_destroy(tpool_t *pool);
+
+#endif
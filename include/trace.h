@@ -0,0 +1,87 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * 操作记录（trace）的文件格式和记录接口。
+ * 开始记录后，naivefs.h 中的每次调用都会追加一条记录：时间戳、参数和结果。
+ * 记录只保存写入的长度而不保存数据，重放时写入固定内容。
+ * replay 工具读取记录文件并在另一个 image 上重新执行。
+ *
+ * 文件格式：trace_header_t，之后是若干条记录，
+ * 每条为 trace_rec_t 头部，后面依次是 path_len 字节的 path 和 path2_len 字节的 path2。
+ */
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x5254464e      // "NFTR"
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TRACE_OP_NOTE = 1,          // shell 执行的命令行，记在 path 中，重放时跳过
+    TRACE_OP_LOOKUP,            // result 为inode号
+    TRACE_OP_STAT,
+    TRACE_OP_MKDIR,
+    TRACE_OP_CREATE,            // result 为新文件的inode号
+    TRACE_OP_READ,
+    TRACE_OP_WRITE,
+    TRACE_OP_READDIR,
+    TRACE_OP_UNLINK,
+    TRACE_OP_RMDIR,
+    TRACE_OP_REMOVE_TREE,
+    TRACE_OP_COPY,
+    TRACE_OP_WALK,
+    TRACE_OP_SNAPSHOT_CREATE,   // 快照名记在 path 中
+    TRACE_OP_SNAPSHOT_DELETE,
+    TRACE_OP_SNAPSHOT_LIST,
+    TRACE_OP_SYNC,
+    TRACE_OP_READDIR_STAT,
+    TRACE_OP_MAX,
+};
+
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+} trace_header_t;
+
+typedef struct trace_rec {
+    uint64_t ts;                // 相对于开始记录的时间，纳秒
+    uint64_t off;
+    uint32_t latency;           // 执行耗时，纳秒
+    uint32_t ino;
+    uint32_t count;
+    int32_t result;
+    uint16_t op;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint16_t reserved;
+} trace_rec_t;
+
+/**
+ * @brief 开始把操作记录到 path，已在记录时先结束之前的记录
+ * @return 成功返回0,失败返回负的错误码
+ */
+int trace_start(const char *path);
+
+/**
+ * @brief 结束记录并关闭记录文件
+ */
+int trace_stop();
+
+/**
+ * @brief 操作开始时调用
+ * @return 正在记录时返回开始时间，否则返回0
+ */
+uint64_t trace_begin();
+
+/**
+ * @brief 操作结束时调用，begin 为 trace_begin 的返回值，为0时什么也不做
+ */
+void trace_end(uint64_t begin,int op,const char *path,const char *path2,
+    uint32_t ino,uint64_t off,uint32_t count,int32_t result);
+
+/**
+ * @brief 当前的单调时钟，纳秒
+ */
+uint64_t trace_now();
+
+#endif
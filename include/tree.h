@@ -0,0 +1,24 @@
+#ifndef _TREE_H
+#define _TREE_H
+
+/*
+ * 递归的目录树操作，均基于 walk.h 中的并行遍历
+ */
+
+#define REMOVE_FILE         0   // 只删除文件
+#define REMOVE_EMPTY_DIR    1   // 只删除空目录
+#define REMOVE_TREE         2   // 删除文件或整棵目录树
+
+/**
+ * @brief 按 mode 删除 path 对应的文件或目录
+ * @return success: 0, fail: 负的错误码
+ */
+int remove_path(const char *path,int mode);
+
+/**
+ * @brief 将 src_path 对应的整棵目录树（或单个文件）复制为 dst_path
+ * @return success: 0, fail: 负的错误码
+ */
+int copy_tree(const char *src_path,const char *dst_path);
+
+#endif
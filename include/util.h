@@ -8,25 +8,24 @@ typedef unsigned short  uint16_t;
 typedef int  int32_t;
 typedef unsigned   uint32_t;
 
-#define MAGICNUM 0x20201222
+#include "layout.h"
 
-#define MAXARGS 10
-#define MAXWORD 30
-#define MAXLINE 100
+// super block 改为记录块大小、块数和inode数后更新。
+// 之前的 image 的幻数为 LEGACY_MAGICNUM 异或 (块大小/1024 - 1)，即只有低5位不同
+#define MAGICNUM 0x20211223
+#define LEGACY_MAGICNUM 0x20201223
+#define IS_LEGACY_MAGICNUM(m) (((uint32_t)(m) & ~0x1fu) == (LEGACY_MAGICNUM & ~0x1fu))
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 
-#define BLOCK_SIZE 1024   // 每块 BLOCK 的大小 1KB
-#define INODE_SIZE 32     // 每块 INODE 大小 32Bytes
-#define DIR_ITEM_SIZE 128 // 每块 DIR_ITEM 大小 128Bytes
+#define DIR_ITEM_HEADER_SIZE 8  // 变长目录项头部大小 8Bytes（名字紧随其后）
+#define DIR_NAME_MAX 255        // 目录项名字最大长度（name_len 为 uint8_t）
 
-#define NDISKBLOCK_PER_DATABLOCK 2
-#define N_INODE_BLOCK 32
-#define N_DATA_BLOCK 4063
+// 名字长度为 name_len 的目录项实际占用的字节数，按 4 字节对齐
+#define DIR_REC_LEN(name_len) (((name_len) + DIR_ITEM_HEADER_SIZE + 3) & ~3)
 
 #define MAX_FILE_BLOCK_NUM 6
-#define MAX_INODE_NUM 1024
 
 /**
  * @brief 将两个字符串拼接，形成新的字符串
@@ -0,0 +1,49 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+#include <pthread.h>
+#include "filesys.h"
+#include "tpool.h"
+
+/*
+ * 并行目录树遍历：每个目录作为一个任务交给工作窃取线程池，
+ * 任务读出目录块中的全部目录项后，按inode表块批量读入子项的inode，
+ * 再为每个子目录派生新任务。遍历结果是一个扁平的节点数组，
+ * 父节点的下标总是小于子节点，逆序扫描即可自底向上汇总。
+ */
+
+typedef struct walk_node {
+    uint32_t inode_id;
+    int parent;                 // 父节点在 nodes 中的下标，根节点为 -1
+    inode_t inode;
+    char *name;                 // 指向 path 中最后一个分量
+    char *path;                 // 完整路径
+} walk_node_t;
+
+typedef struct walk {
+    walk_node_t *nodes;
+    int count;
+    int cap;
+    int error;                  // 遍历中是否发生读错误
+    pthread_mutex_t lock;
+    tpool_group_t tasks;        // 本次遍历派生的任务，并发的遍历各自等待自己的任务
+} walk_t;
+
+/**
+ * @brief 从 inode_id（路径为 path）开始并行遍历整棵子树
+ *        根节点也会出现在结果中（下标为0），根为文件时结果只有它一个
+ * @return 成功返回0,失败返回-1
+ */
+int walk_tree(walk_t *w,uint32_t inode_id,const char *path);
+
+/**
+ * @brief 释放遍历结果
+ */
+void walk_free(walk_t *w);
+
+/**
+ * @brief 返回按路径字典序排列的节点下标数组，由调用者 free
+ */
+int* walk_sorted(walk_t *w);
+
+#endif
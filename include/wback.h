@@ -0,0 +1,75 @@
+#ifndef WBACK_H
+#define WBACK_H
+
+/*
+ * Writeback of dirty disk blocks.
+ *
+ * disk_write_block() leaves the new content of a block here instead of
+ * writing it to the image at once. A later write of the same block just
+ * replaces the buffered copy, so a block that is written many times (the
+ * superblock is written several times per mkdir) reaches the image once.
+ * A flush writes the dirty blocks in block order, and each run of adjacent
+ * blocks goes out as a single vectored write.
+ *
+ * A flush happens when WBACK_MAX_DIRTY blocks are dirty, every
+ * WBACK_INTERVAL_MS milliseconds from a background thread, and whenever
+ * wback_flush() is called (disk_flush(), close_disk()). Until then the
+ * dirty copy is the authoritative one: disk.c looks here before reading
+ * the image.
+ */
+
+#include <sys/uio.h>
+
+#define WBACK_MAX_DIRTY 256
+#define WBACK_INTERVAL_MS 100
+
+// Writes iov[0..n) to the n consecutive blocks starting at first,
+// returns 0 on success, -1 otherwise.
+typedef int (*wback_write_fn)(unsigned int first, const struct iovec* iov, int n);
+
+/**
+ * @brief Set up writeback for a disk of nblocks blocks and start the
+ * flusher thread. Buffers are aligned to align bytes, so that write_run may
+ * use direct I/O. Called by open_disk().
+ *
+ * @return returns 0 on success, -1 otherwise.
+ */
+int wback_init(unsigned int nblocks, unsigned int align, wback_write_fn write_run);
+
+/**
+ * @brief Stop the flusher thread, flush and free everything. Called by close_disk().
+ *
+ * @return returns 0 on success, -1 if some blocks could not be written
+ * (they are lost).
+ */
+int wback_destroy();
+
+/**
+ * @brief Copy the dirty content of block_num into buf.
+ *
+ * @return returns 0 if the block is dirty, -1 otherwise.
+ */
+int wback_lookup(unsigned int block_num, char* buf);
+
+/**
+ * @brief Record buf as the new content of block_num. Flushes first if
+ * WBACK_MAX_DIRTY blocks are already dirty.
+ *
+ * @return returns 0 on success, -1 otherwise (nothing is recorded).
+ */
+int wback_add(unsigned int block_num, const char* buf);
+
+/**
+ * @brief Forget the dirty content of blocks [block_num, block_num + count).
+ */
+void wback_drop(unsigned int block_num, unsigned int count);
+
+/**
+ * @brief Write every dirty block to the image.
+ *
+ * @return returns 0 on success, -1 otherwise; blocks that could not be
+ * written stay dirty and are retried by the next flush.
+ */
+int wback_flush();
+
+#endif
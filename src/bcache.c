@@ -0,0 +1,136 @@
+#include "disk.h"
+#include "bcache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct bcache_entry {
+        unsigned int block_num;
+        int valid;
+        int ref;                // clock reference bit
+        char data[DEVICE_BLOCK_SIZE];
+} bcache_entry_t;
+
+typedef struct bcache_set {
+        pthread_mutex_t lock;
+        int hand;               // clock hand
+        bcache_entry_t ways[BCACHE_WAYS];
+} bcache_set_t;
+
+static bcache_set_t* sets;
+static unsigned int nsets;
+
+static bcache_entry_t* find_way(bcache_set_t* s, unsigned int block_num)
+{
+        for(int i = 0; i < BCACHE_WAYS; i++){
+                if(s->ways[i].valid && s->ways[i].block_num == block_num){
+                        return &s->ways[i];
+                }
+        }
+        return NULL;
+}
+
+int bcache_init(unsigned int nblocks)
+{
+        bcache_destroy();
+        if(nblocks > BCACHE_MAX_BLOCKS){
+                nblocks = BCACHE_MAX_BLOCKS;
+        }
+        nsets = (nblocks + BCACHE_WAYS - 1) / BCACHE_WAYS;
+        if(nsets == 0){
+                nsets = 1;
+        }
+        sets = (bcache_set_t*)calloc(nsets, sizeof(bcache_set_t));
+        if(sets == NULL){
+                nsets = 0;
+                return -1;
+        }
+        for(unsigned int i = 0; i < nsets; i++){
+                pthread_mutex_init(&sets[i].lock, NULL);
+        }
+        return 0;
+}
+
+void bcache_destroy()
+{
+        for(unsigned int i = 0; i < nsets; i++){
+                pthread_mutex_destroy(&sets[i].lock);
+        }
+        free(sets);
+        sets = NULL;
+        nsets = 0;
+}
+
+int bcache_lookup(unsigned int block_num, char* buf)
+{
+        if(nsets == 0){
+                return -1;
+        }
+        bcache_set_t* s = &sets[block_num % nsets];
+        int r = -1;
+        pthread_mutex_lock(&s->lock);
+        bcache_entry_t* e = find_way(s, block_num);
+        if(e != NULL){
+                memcpy(buf, e->data, DEVICE_BLOCK_SIZE);
+                e->ref = 1;
+                r = 0;
+        }
+        pthread_mutex_unlock(&s->lock);
+        return r;
+}
+
+void bcache_insert(unsigned int block_num, const char* buf)
+{
+        if(nsets == 0){
+                return;
+        }
+        bcache_set_t* s = &sets[block_num % nsets];
+        pthread_mutex_lock(&s->lock);
+        bcache_entry_t* e = find_way(s, block_num);
+        for(int i = 0; e == NULL && i < BCACHE_WAYS; i++){
+                if(!s->ways[i].valid){
+                        e = &s->ways[i];
+                }
+        }
+        while(e == NULL){
+                bcache_entry_t* victim = &s->ways[s->hand];
+                s->hand = (s->hand + 1) % BCACHE_WAYS;
+                if(victim->ref){
+                        victim->ref = 0;
+                } else {
+                        e = victim;
+                }
+        }
+        e->block_num = block_num;
+        e->valid = 1;
+        e->ref = 1;
+        memcpy(e->data, buf, DEVICE_BLOCK_SIZE);
+        pthread_mutex_unlock(&s->lock);
+}
+
+void bcache_invalidate(unsigned int block_num, unsigned int count)
+{
+        // A range larger than the cache is cheaper to drop by scanning every way.
+        if(count / BCACHE_WAYS >= nsets){
+                for(unsigned int i = 0; i < nsets; i++){
+                        bcache_set_t* s = &sets[i];
+                        pthread_mutex_lock(&s->lock);
+                        for(int w = 0; w < BCACHE_WAYS; w++){
+                                if(s->ways[w].valid && s->ways[w].block_num - block_num < count){
+                                        s->ways[w].valid = 0;
+                                }
+                        }
+                        pthread_mutex_unlock(&s->lock);
+                }
+                return;
+        }
+        for(unsigned int b = block_num; nsets != 0 && b < block_num + count; b++){
+                bcache_set_t* s = &sets[b % nsets];
+                pthread_mutex_lock(&s->lock);
+                bcache_entry_t* e = find_way(s, b);
+                if(e != NULL){
+                        e->valid = 0;
+                }
+                pthread_mutex_unlock(&s->lock);
+        }
+}
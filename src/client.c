@@ -0,0 +1,147 @@
+#include "client.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+struct nfsc {
+    int fd;
+    char *buf;                  // 最近一次收到的响应帧
+    size_t cap;
+};
+
+nfsc_t* nfsc_connect(const char *socket_path){
+    struct sockaddr_un addr;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)){
+        return NULL;
+    }
+    nfsc_t *c = (nfsc_t*)calloc(1,sizeof(nfsc_t));
+    if(c==NULL){
+        return NULL;
+    }
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,socket_path);
+    c->fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(c->fd<0 || connect(c->fd,(struct sockaddr*)&addr,sizeof(addr))<0){
+        if(c->fd>=0){
+            close(c->fd);
+        }
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void nfsc_close(nfsc_t *c){
+    if(c==NULL){
+        return;
+    }
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static int write_all(int fd,struct iovec *iov,int n){
+    while(n>0){
+        ssize_t w = writev(fd,iov,n);
+        if(w<0){
+            if(errno==EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        while(n>0 && (size_t)w>=iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n>0){
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+static int read_all(int fd,void *buf,size_t len){
+    size_t done = 0;
+    while(done<len){
+        ssize_t r = read(fd,(char*)buf+done,len-done);
+        if(r==0){
+            return -ECONNRESET;
+        }
+        if(r<0){
+            if(errno==EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+int nfsc_send(nfsc_t *c,uint32_t tag,int op,const char *path,const char *path2,
+    nfs_ino_t ino,uint64_t off,const void *data,uint32_t count){
+    nfs_req_t req;
+    size_t path_len = path ? strlen(path) : 0;
+    size_t rest_len = 0;
+    const void *rest = NULL;
+    if(op==NFS_OP_COPY && path2){
+        rest = path2;
+        rest_len = strlen(path2);
+    } else if(op==NFS_OP_WRITE){
+        rest = data;
+        rest_len = count;
+    }
+    if(path_len>UINT16_MAX || sizeof(req)+path_len+rest_len>NFS_PROTO_MAX_FRAME){
+        return -E2BIG;
+    }
+    memset(&req,0,sizeof(req));
+    req.len = sizeof(req) + path_len + rest_len;
+    req.tag = tag;
+    req.off = off;
+    req.ino = ino;
+    req.count = count;
+    req.op = op;
+    req.path_len = path_len;
+    struct iovec iov[3] = {
+        {&req,sizeof(req)},
+        {(void*)path,path_len},
+        {(void*)rest,rest_len},
+    };
+    return write_all(c->fd,iov,3);
+}
+
+int nfsc_recv(nfsc_t *c,nfsc_reply_t *reply){
+    nfs_resp_t resp;
+    int r = read_all(c->fd,&resp,sizeof(resp));
+    if(r<0){
+        return r;
+    }
+    if(resp.len<sizeof(resp) || resp.len>NFS_PROTO_MAX_FRAME){
+        return -EPROTO;
+    }
+    size_t len = resp.len - sizeof(resp);
+    if(len>c->cap){
+        char *buf = (char*)realloc(c->buf,len);
+        if(buf==NULL){
+            return -ENOMEM;
+        }
+        c->buf = buf;
+        c->cap = len;
+    }
+    r = read_all(c->fd,c->buf,len);
+    if(r<0){
+        return r;
+    }
+    reply->tag = resp.tag;
+    reply->result = resp.result;
+    reply->data = c->buf;
+    reply->data_len = len;
+    return 0;
+}
@@ -1,78 +1,397 @@
+#define _GNU_SOURCE
 #include "disk.h"
+#include "snapshot.h"
+#include "bcache.h"
+#include "wback.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 
-inline int get_disk_size()
+// pread/pwrite carry their own offset, so several threads may do I/O on
+// the same descriptor at once (the tree walker relies on this).
+static int disk = -1;
+static unsigned int nblocks;            // size of the open disk
+static unsigned long long create_size = DISK_SIZE;
+
+static atomic_ulong nreads, ncache_hits, nwrites, ndiscards;
+static atomic_ulong nflushed, nwrite_ios;
+
+// Direct I/O. The block cache already keeps every block we have read, so
+// going through the host page cache as well only doubles the memory spent
+// on each image. O_DIRECT wants the buffer, the offset and the length
+// aligned to the host device; offsets and lengths are whole device blocks,
+// and callers' buffers, which are plain char arrays, are bounced through a
+// slab of page-aligned buffers that is reused across requests.
+#define DIO_POOL_SIZE 64
+
+static int direct_wanted;
+static int direct;
+static size_t dio_align;
+static char* dio_slab;
+static int dio_free[DIO_POOL_SIZE];
+static int dio_nfree;
+static pthread_mutex_t dio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int dio_init(void)
+{
+        long page = sysconf(_SC_PAGESIZE);
+        dio_align = page > DEVICE_BLOCK_SIZE ? (size_t)page : DEVICE_BLOCK_SIZE;
+        if(posix_memalign((void**)&dio_slab, dio_align, DIO_POOL_SIZE * dio_align) != 0){
+                dio_slab = NULL;
+                return -1;
+        }
+        for(int i = 0; i < DIO_POOL_SIZE; i++){
+                dio_free[i] = i;
+        }
+        dio_nfree = DIO_POOL_SIZE;
+        return 0;
+}
+
+static void dio_destroy(void)
+{
+        free(dio_slab);
+        dio_slab = NULL;
+        dio_nfree = 0;
+}
+
+// Takes a buffer from the slab; when more than DIO_POOL_SIZE requests are in
+// flight the extra ones get a buffer of their own.
+static char* dio_get(void)
+{
+        char* b = NULL;
+        pthread_mutex_lock(&dio_lock);
+        if(dio_nfree > 0){
+                b = dio_slab + (size_t)dio_free[--dio_nfree] * dio_align;
+        }
+        pthread_mutex_unlock(&dio_lock);
+        if(b == NULL && posix_memalign((void**)&b, dio_align, dio_align) != 0){
+                return NULL;
+        }
+        return b;
+}
+
+static void dio_put(char* b)
+{
+        if(b < dio_slab || b >= dio_slab + DIO_POOL_SIZE * dio_align){
+                free(b);
+                return;
+        }
+        pthread_mutex_lock(&dio_lock);
+        dio_free[dio_nfree++] = (int)((b - dio_slab) / dio_align);
+        pthread_mutex_unlock(&dio_lock);
+}
+
+static int dio_aligned(const char* buf)
+{
+        return ((uintptr_t)buf & (dio_align - 1)) == 0;
+}
+
+static int io_read(unsigned int block_num, char* buf)
+{
+        off_t off = (off_t)block_num * DEVICE_BLOCK_SIZE;
+        if(!direct || dio_aligned(buf)){
+                return pread(disk, buf, DEVICE_BLOCK_SIZE, off) == DEVICE_BLOCK_SIZE ? 0 : -1;
+        }
+        char* b = dio_get();
+        if(b == NULL){
+                return -1;
+        }
+        int r = pread(disk, b, DEVICE_BLOCK_SIZE, off) == DEVICE_BLOCK_SIZE ? 0 : -1;
+        if(r == 0){
+                memcpy(buf, b, DEVICE_BLOCK_SIZE);
+        }
+        dio_put(b);
+        return r;
+}
+
+static int io_write(unsigned int block_num, const char* buf)
+{
+        off_t off = (off_t)block_num * DEVICE_BLOCK_SIZE;
+        if(!direct || dio_aligned(buf)){
+                return pwrite(disk, buf, DEVICE_BLOCK_SIZE, off) == DEVICE_BLOCK_SIZE ? 0 : -1;
+        }
+        char* b = dio_get();
+        if(b == NULL){
+                return -1;
+        }
+        memcpy(b, buf, DEVICE_BLOCK_SIZE);
+        int r = pwrite(disk, b, DEVICE_BLOCK_SIZE, off) == DEVICE_BLOCK_SIZE ? 0 : -1;
+        dio_put(b);
+        return r;
+}
+
+// Opens path for direct I/O if the host file system takes it: tmpfs refuses
+// O_DIRECT outright, and devices with 4 KiB sectors refuse our 512 byte
+// requests, which the probe read of block 0 finds out. Falls back to
+// buffered I/O in both cases.
+static int open_direct(const char* path)
+{
+        if(dio_init() < 0){
+                return -1;
+        }
+        int fd = open(path, O_RDWR | O_DIRECT);
+        if(fd == -1){
+                dio_destroy();
+                return -1;
+        }
+        char* b = dio_get();
+        if(b == NULL || pread(fd, b, DEVICE_BLOCK_SIZE, 0) != DEVICE_BLOCK_SIZE){
+                if(b != NULL){
+                        dio_put(b);
+                }
+                close(fd);
+                dio_destroy();
+                return -1;
+        }
+        dio_put(b);
+        direct = 1;
+        return fd;
+}
+
+// Called by the writeback stage with one run of adjacent dirty blocks. The
+// buffers come from wback_add() and are aligned for direct I/O already.
+static int write_run(unsigned int first, const struct iovec* iov, int n)
+{
+        ssize_t want = (ssize_t)n * DEVICE_BLOCK_SIZE;
+        atomic_fetch_add(&nwrite_ios, 1);
+        if(pwritev(disk, iov, n, (off_t)first * DEVICE_BLOCK_SIZE) != want){
+                return -1;
+        }
+        atomic_fetch_add(&nflushed, n);
+        return 0;
+}
+
+void disk_use_direct(int on)
 {
-        return 4*1024*1024; 
+        direct_wanted = on;
 }
 
-static FILE* disk;
+int disk_is_direct()
+{
+        return direct;
+}
 
-static int create_disk()
+int disk_set_create_size(unsigned long long size)
 {
-        FILE* tmp = fopen("disk","w");
-        for(int i = 0; i < get_disk_size(); i++){
-                fputc(0,tmp);
+        if(size == 0){
+                size = DISK_SIZE;
+        }
+        if(size < DEVICE_BLOCK_SIZE || size > DISK_MAX_SIZE){
+                return -1;
         }
-        fclose(tmp);
+        create_size = size;
+        return 0;
+}
+
+unsigned int disk_nblocks()
+{
+        return nblocks;
+}
+
+// The image is created sparse: nothing is written, and blocks read back as
+// zeros until the file system first writes them.
+static int create_disk(const char* path)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(fd == -1){
+                return -1;
+        }
+        int r = ftruncate(fd, (off_t)create_size);
+        close(fd);
+        return r;
 }
 
 int open_disk()
 {
-        if(disk != 0){
+        return open_disk_file(DISK_FILE);
+}
+
+int open_disk_file(const char* path)
+{
+        if(disk != -1){
+                return -1;
+        }
+        if(access(path, F_OK) != 0 && create_disk(path) < 0){
                 return -1;
         }
-        disk = fopen("disk","r+");
-        if(disk == 0){
-                create_disk();
-                disk = fopen("disk","r+");
-                if(disk == 0){
+        if(direct_wanted){
+                disk = open_direct(path);
+        }
+        if(disk == -1){
+                disk = open(path,O_RDWR);
+                if(disk == -1){
                         return -1;
                 }
         }
+        struct stat st;
+        if(fstat(disk, &st) < 0 || (unsigned long long)st.st_size > DISK_MAX_SIZE){
+                goto fail;
+        }
+        nblocks = st.st_size / DEVICE_BLOCK_SIZE;
+        if(snapshot_open(path) < 0){
+                goto fail;
+        }
+        // Sized to hold the whole image, up to BCACHE_MAX_BLOCKS.
+        if(bcache_init(nblocks) < 0){
+                snapshot_close();
+                goto fail;
+        }
+        if(wback_init(nblocks, direct ? dio_align : 64, write_run) < 0){
+                bcache_destroy();
+                snapshot_close();
+                goto fail;
+        }
         return 0;
+
+fail:
+        close(disk);
+        disk = -1;
+        nblocks = 0;
+        if(direct){
+                direct = 0;
+                dio_destroy();
+        }
+        return -1;
 }
 
-int disk_read_block(unsigned int block_num, char* buf)
+int disk_read_raw(unsigned int block_num, char* buf)
 {
-        if(disk == 0){
+        if(disk == -1 || block_num >= nblocks){
                 return -1;
         }
-        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
+        return io_read(block_num, buf);
+}
+
+int disk_read_block_nofill(unsigned int block_num, char* buf, int* cached)
+{
+        if(disk == -1 || block_num >= nblocks){
                 return -1;
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
-                return -1;
+        atomic_fetch_add(&nreads, 1);
+        if(bcache_lookup(block_num, buf) == 0){
+                atomic_fetch_add(&ncache_hits, 1);
+                *cached = 1;
+                return 0;
+        }
+        *cached = 0;
+        if(snapshot_view() != NULL){
+                return snapshot_read_block(block_num, buf);
+        }
+        if(wback_lookup(block_num, buf) == 0){
+                return 0;
         }
-        if(fread(buf, DEVICE_BLOCK_SIZE,1,disk) != 1){
+        return disk_read_raw(block_num, buf);
+}
+
+void disk_fill_block(unsigned int block_num, const char* buf)
+{
+        bcache_insert(block_num, buf);
+}
+
+int disk_read_block(unsigned int block_num, char* buf)
+{
+        int cached;
+        if(disk_read_block_nofill(block_num, buf, &cached) < 0){
                 return -1;
         }
+        if(!cached){
+                disk_fill_block(block_num, buf);
+        }
         return 0;
 }
 
 int disk_write_block(unsigned int block_num, char* buf)
 {
-        if(disk == 0){
+        if(disk == -1 || block_num >= nblocks){
                 return -1;
         }
-        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
+        atomic_fetch_add(&nwrites, 1);
+        int r;
+        if(snapshot_view() != NULL){
+                r = snapshot_write_block(block_num, buf);
+        } else if(snapshot_preserve(block_num, 1) < 0){
+                r = -1;
+        } else if(wback_add(block_num, buf) == 0){
+                r = 0;
+        } else {
+                r = io_write(block_num, buf);
+        }
+        // A failed write may have left the block half written.
+        if(r == 0){
+                bcache_insert(block_num, buf);
+        } else {
+                bcache_invalidate(block_num, 1);
+        }
+        return r;
+}
+
+int disk_discard_blocks(unsigned int block_num, unsigned int count)
+{
+        if(disk == -1 || block_num > nblocks || count > nblocks - block_num){
                 return -1;
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
+        if(snapshot_view() != NULL){
+                return 0;
+        }
+        if(snapshot_preserve(block_num, count) < 0){
                 return -1;
         }
-        if(fwrite(buf,DEVICE_BLOCK_SIZE,1,disk) != 1){
+        atomic_fetch_add(&ndiscards, count);
+        wback_drop(block_num, count);
+        bcache_invalidate(block_num, count);
+#ifdef FALLOC_FL_PUNCH_HOLE
+        return fallocate(disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)block_num * DEVICE_BLOCK_SIZE, (off_t)count * DEVICE_BLOCK_SIZE);
+#else
+        return -1;
+#endif
+}
+
+void disk_get_stats(disk_stats_t* stats)
+{
+        stats->reads = atomic_load(&nreads);
+        stats->cache_hits = atomic_load(&ncache_hits);
+        stats->writes = atomic_load(&nwrites);
+        stats->discards = atomic_load(&ndiscards);
+        stats->flushed = atomic_load(&nflushed);
+        stats->write_ios = atomic_load(&nwrite_ios);
+}
+
+int disk_flush()
+{
+        if(disk == -1){
                 return -1;
         }
-        return 0;
+        return wback_flush();
 }
 
 int close_disk()
 {
-        if(disk == 0){
+        if(disk == -1){
                 return -1;
         }
-        int r = fclose(disk);
-        disk = 0;
+        int r = wback_destroy();
+        snapshot_close();
+        bcache_destroy();
+        if(close(disk) < 0){
+                r = -1;
+        }
+        disk = -1;
+        nblocks = 0;
+        if(direct){
+                direct = 0;
+                dio_destroy();
+        }
         return r;
 }
\ No newline at end of file
@@ -0,0 +1,345 @@
+#include "extent.h"
+#include <stdlib.h>
+#include <errno.h>
+
+static int bucket_of(uint32_t len){
+    return 31 - __builtin_clz(len);
+}
+
+static void bucket_add(extent_index_t *x,extent_t *e){
+    int k = bucket_of(e->len);
+    e->prev = NULL;
+    e->next = x->buckets[k];
+    if(x->buckets[k]!=NULL){
+        x->buckets[k]->prev = e;
+    }
+    x->buckets[k] = e;
+}
+
+static void bucket_del(extent_index_t *x,extent_t *e){
+    if(e->prev!=NULL){
+        e->prev->next = e->next;
+    } else {
+        x->buckets[bucket_of(e->len)] = e->next;
+    }
+    if(e->next!=NULL){
+        e->next->prev = e->prev;
+    }
+}
+
+static int height(extent_t *e){
+    return e ? e->height : 0;
+}
+
+static void update(extent_t *e){
+    int l = height(e->left), r = height(e->right);
+    e->height = (l>r ? l : r) + 1;
+}
+
+static extent_t* rotate_right(extent_t *e){
+    extent_t *l = e->left;
+    e->left = l->right;
+    l->right = e;
+    update(e);
+    update(l);
+    return l;
+}
+
+static extent_t* rotate_left(extent_t *e){
+    extent_t *r = e->right;
+    e->right = r->left;
+    r->left = e;
+    update(e);
+    update(r);
+    return r;
+}
+
+static extent_t* balance(extent_t *e){
+    update(e);
+    int d = height(e->left) - height(e->right);
+    if(d>1){
+        if(height(e->left->left)<height(e->left->right)){
+            e->left = rotate_left(e->left);
+        }
+        return rotate_right(e);
+    }
+    if(d<-1){
+        if(height(e->right->right)<height(e->right->left)){
+            e->right = rotate_right(e->right);
+        }
+        return rotate_left(e);
+    }
+    return e;
+}
+
+static extent_t* tree_insert(extent_t *t,extent_t *e){
+    if(t==NULL){
+        e->left = e->right = NULL;
+        e->height = 1;
+        return e;
+    }
+    if(e->start<t->start){
+        t->left = tree_insert(t->left,e);
+    } else {
+        t->right = tree_insert(t->right,e);
+    }
+    return balance(t);
+}
+
+static extent_t* tree_remove_min(extent_t *t,extent_t **min){
+    if(t->left==NULL){
+        *min = t;
+        return t->right;
+    }
+    t->left = tree_remove_min(t->left,min);
+    return balance(t);
+}
+
+static extent_t* tree_remove(extent_t *t,uint32_t start){
+    if(t==NULL){
+        return NULL;
+    }
+    if(start<t->start){
+        t->left = tree_remove(t->left,start);
+    } else if(start>t->start){
+        t->right = tree_remove(t->right,start);
+    } else {
+        extent_t *l = t->left, *r = t->right, *min;
+        if(r==NULL){
+            return l;
+        }
+        r = tree_remove_min(r,&min);
+        min->left = l;
+        min->right = r;
+        return balance(min);
+    }
+    return balance(t);
+}
+
+/**
+ * @brief 起点不大于 v 的最后一个区间
+ */
+static extent_t* tree_floor(extent_index_t *x,uint32_t v){
+    extent_t *t = x->root, *best = NULL;
+    while(t!=NULL){
+        if(t->start<=v){
+            best = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief 起点大于 v 的第一个区间
+ */
+static extent_t* tree_next(extent_index_t *x,uint32_t v){
+    extent_t *t = x->root, *best = NULL;
+    while(t!=NULL){
+        if(t->start>v){
+            best = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    return best;
+}
+
+static void insert(extent_index_t *x,extent_t *e){
+    x->root = tree_insert(x->root,e);
+    bucket_add(x,e);
+}
+
+static void erase(extent_index_t *x,extent_t *e){
+    x->root = tree_remove(x->root,e->start);
+    bucket_del(x,e);
+}
+
+static int add(extent_index_t *x,uint32_t start,uint32_t len){
+    extent_t *e = (extent_t*)malloc(sizeof(extent_t));
+    if(e==NULL){
+        return -ENOMEM;
+    }
+    e->start = start;
+    e->len = len;
+    insert(x,e);
+    return 0;
+}
+
+static void free_tree(extent_t *t){
+    if(t!=NULL){
+        free_tree(t->left);
+        free_tree(t->right);
+        free(t);
+    }
+}
+
+void extent_reset(extent_index_t *x){
+    free_tree(x->root);
+    x->root = NULL;
+    for(int k=0;k<EXTENT_NBUCKET;k++){
+        x->buckets[k] = NULL;
+    }
+    x->nfree = 0;
+    x->ready = 0;
+}
+
+int extent_ready(extent_index_t *x){
+    return x->ready;
+}
+
+int extent_add_map(extent_index_t *x,const uint32_t *map,uint32_t first,uint32_t end){
+    if(!x->ready){
+        extent_reset(x);
+        x->ready = 1;
+    }
+    uint32_t b = first;
+    while(b<end){
+        if(b%32==0 && map[b/32]==0xffffffff){
+            b += 32;
+            continue;
+        }
+        if(map[b/32] & (0x80000000 >> (b%32))){
+            b++;
+            continue;
+        }
+        uint32_t start = b;
+        while(b<end && !(map[b/32] & (0x80000000 >> (b%32)))){
+            b++;
+        }
+        if(extent_free(x,start,b-start)<0){     // 与相邻组中已加入的区间合并
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 从区间 e 中取出 [from, from+n)，剩余部分留在索引中
+ * @return 成功返回0,内存不足返回-ENOMEM（此时索引不变）
+ */
+static int take(extent_index_t *x,extent_t *e,uint32_t from,uint32_t n,uint32_t *blocks){
+    uint32_t end = e->start + e->len;
+    extent_t *rest = NULL;
+    if(from>e->start && from+n<end){    // 从中间取，分裂为两段
+        rest = (extent_t*)malloc(sizeof(extent_t));
+        if(rest==NULL){
+            return -ENOMEM;
+        }
+    }
+    erase(x,e);
+    if(from>e->start){
+        e->len = from - e->start;
+        insert(x,e);
+        if(rest!=NULL){
+            rest->start = from + n;
+            rest->len = end - rest->start;
+            insert(x,rest);
+        }
+    } else if(from+n<end){
+        e->start = from + n;
+        e->len = end - e->start;
+        insert(x,e);
+    } else {
+        free(e);
+    }
+    for(uint32_t i=0;i<n;i++){
+        blocks[i] = from + i;
+    }
+    x->nfree -= n;
+    return 0;
+}
+
+/**
+ * @brief 能容纳 n 块的区间：先找 n 所在的桶中第一个够长的，再找更大的非空桶
+ */
+static extent_t* find_fit(extent_index_t *x,uint32_t n){
+    int k = bucket_of(n);
+    for(extent_t *e=x->buckets[k];e!=NULL;e=e->next){
+        if(e->len>=n){
+            return e;
+        }
+    }
+    for(k++;k<EXTENT_NBUCKET;k++){
+        if(x->buckets[k]!=NULL){
+            return x->buckets[k];
+        }
+    }
+    return NULL;
+}
+
+static extent_t* find_largest(extent_index_t *x){
+    for(int k=EXTENT_NBUCKET-1;k>=0;k--){
+        if(x->buckets[k]!=NULL){
+            return x->buckets[k];
+        }
+    }
+    return NULL;
+}
+
+int extent_alloc(extent_index_t *x,uint32_t goal,uint32_t n,uint32_t *blocks){
+    if(n>x->nfree){
+        return -ENOSPC;
+    }
+    uint32_t done = 0;
+    int r = 0;
+    if(goal!=0 && n>0){
+        extent_t *e = tree_floor(x,goal);
+        if(e!=NULL && goal<e->start+e->len){
+            uint32_t m = e->start + e->len - goal;
+            r = take(x,e,goal,m<n ? m : n,blocks);
+            done = m<n ? m : n;
+        }
+    }
+    if(r==0 && done<n){
+        extent_t *e = find_fit(x,n-done);
+        if(e!=NULL){
+            r = take(x,e,e->start,n-done,blocks+done);
+            done = n;
+        }
+    }
+    while(r==0 && done<n){              // 没有足够长的区间，从最长的开始拼
+        extent_t *e = find_largest(x);
+        uint32_t m = e->len<n-done ? e->len : n-done;
+        r = take(x,e,e->start,m,blocks+done);
+        done += m;
+    }
+    if(r<0){        // 已取出的块尚未记入位图，丢弃索引，下次重建
+        extent_reset(x);
+    }
+    return r;
+}
+
+int extent_free(extent_index_t *x,uint32_t start,uint32_t n){
+    extent_t *prev = start>0 ? tree_floor(x,start-1) : NULL;
+    extent_t *next = tree_next(x,start);
+    if(prev!=NULL && prev->start+prev->len!=start){
+        prev = NULL;
+    }
+    if(next!=NULL && start+n!=next->start){
+        next = NULL;
+    }
+    x->nfree += n;
+    if(prev!=NULL){
+        erase(x,prev);
+        prev->len += n;
+        if(next!=NULL){
+            erase(x,next);
+            prev->len += next->len;
+            free(next);
+        }
+        insert(x,prev);
+    } else if(next!=NULL){
+        erase(x,next);
+        next->start = start;
+        next->len += n;
+        insert(x,next);
+    } else if(add(x,start,n)<0){
+        extent_reset(x);
+        return -ENOMEM;
+    }
+    return 0;
+}
@@ -1,357 +1,1407 @@
 #include "disk.h"
 #include "util.h"
 #include "filesys.h"
+#include "tree.h"
+#include "snapshot.h"
+#include "extent.h"
+#include "crc32c.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-char sp_block_buf[2*DEVICE_BLOCK_SIZE];
+layout_t fs_layout;                 // 挂载的文件系统的布局，见 layout.h
+char sp_block_buf[DEVICE_BLOCK_SIZE];   // super block，挂载时读入，之后以这里为准
 char disk_block_buf[DEVICE_BLOCK_SIZE];
 inode_t inode_buf;
-dir_item_t dir_item_buf;
-dir_item_t block_buf[8];
+char block_buf[BLOCK_SIZE];         // 一个目录块的缓冲
+int discard = 0;                    // 释放数据块时是否在宿主文件中打洞
+int format_csum = 0;                // 格式化时是否开启元数据校验
+int csum = 0;                       // 挂载的文件系统是否开启了元数据校验
+static uint64_t format_size = 0;    // 格式化时的 image 大小和inode数，见 set_format
+static uint64_t format_ninodes = 0;
+static int sp_dirty = 0;            // sp_block_buf 中有尚未写盘的修改，见 sync_spblock
+static extent_index_t block_index;  // 空闲数据块的索引
+static extent_index_t inode_index;  // 空闲inode的索引
 
+int write_spblock();
+static int itable_read(int disk_id,char *buf);
+
+/**
+ * @brief 以块号 id 为种子计算 buf 的 CRC32C
+ */
+static uint32_t block_csum(uint32_t id,const char *buf,size_t len){
+    return crc32c(crc32c(0,&id,sizeof(id)),buf,len);
+}
+
+/**
+ * @brief super block 的校验和，跳过 checksum 字段本身
+ */
+static uint32_t sp_csum(sp_block_t *sp_block){
+    size_t off = offsetof(sp_block_t,checksum);
+    size_t rest = off + sizeof(sp_block->checksum);
+    uint32_t crc = crc32c(0,sp_block,off);
+    return crc32c(crc,(char*)sp_block + rest,sizeof(sp_block_t) - rest);
+}
+
+/*
+ * 元数据数组（块占用位图、inode占用位图等，见 layout.h）：挂载时只分配内存，
+ * 每个 disk block 在第一次用到时才读入（与inode表一样按需），之后以内存中的为准，
+ * 因此挂载时间与 image 大小无关。格式化时也只写有非0内容的 disk block，从未写过的读出为全0，
+ * 因此格式化的时间和写盘量也与 image 大小无关。
+ * 修改时记下所在的 disk block，sync_spblock 只写这些 disk block，
+ * 因此一次操作写盘的量与数组的大小无关。
+ * 块占用位图和inode占用位图的空闲区间索引也按 disk block 分组，分配时按需加入（见 index_ensure）
+ */
+typedef struct meta_array {
+    uint32_t *words;
+    uint32_t nwords;
+    uint32_t start;                 // 第一个 disk block
+    uint32_t ndisk;                 // disk block 数
+    atomic_uchar *loaded;           // 每个 disk block 一个标记：已读入（或格式化时已填好）
+    uint32_t *dirty;                // 被修改过的 disk block（相对 start），共 ndirty 个
+    uint32_t ndirty;
+    uint8_t *is_dirty;              // 每个 disk block 一个标记，同一块只记一次
+    uint8_t *indexed;               // 每个 disk block 一个标记：其中的空闲位已加入空闲区间索引
+    uint32_t scan;                  // index_ensure 下一个要检查的 disk block
+} meta_array_t;
+
+static meta_array_t bmap;           // 块占用位图
+static meta_array_t imap;           // inode占用位图
+static meta_array_t itinit;         // 已初始化的inode表块，第 i 位对应inode表的第 i 块
+static meta_array_t icsum;          // inode表每个 disk block 的校验和，只在开启元数据校验时使用
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;   // 读入 disk block 时持有，只读的接口也会读入
+
+static void meta_free(meta_array_t *m){
+    free(m->words);
+    free(m->loaded);
+    free(m->dirty);
+    free(m->is_dirty);
+    free(m->indexed);
+    memset(m,0,sizeof(meta_array_t));
+}
+
+/**
+ * @brief 为从 block_id 号块开始、共 nwords 个 uint32 的元数据数组分配内存，内容为全0，
+ *        loaded 为1时视为已全部读入（格式化），否则各 disk block 在用到时才读入
+ * @return 成功返回0,内存不足返回-1
+ */
+static int meta_alloc(meta_array_t *m,uint32_t block_id,uint32_t nwords,int loaded){
+    uint32_t ndisk = meta_disk_blocks(nwords);
+    size_t n = ndisk>0 ? ndisk : 1;
+    memset(m,0,sizeof(meta_array_t));
+    m->words = (uint32_t*)calloc(nwords>0 ? nwords : 1,sizeof(uint32_t));    // 未用到的页不占物理内存
+    m->loaded = (atomic_uchar*)malloc(sizeof(atomic_uchar) * n);
+    m->dirty = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    m->is_dirty = (uint8_t*)calloc(n,1);
+    m->indexed = (uint8_t*)calloc(n,1);
+    if(m->words==NULL || m->loaded==NULL || m->dirty==NULL || m->is_dirty==NULL || m->indexed==NULL){
+        meta_free(m);
+        return -1;
+    }
+    for(size_t d=0;d<n;d++){
+        atomic_init(&m->loaded[d],loaded);
+    }
+    m->nwords = nwords;
+    m->ndisk = ndisk;
+    m->start = block_disk_block(block_id);
+    return 0;
+}
+
+/**
+ * @brief 第 d 个 disk block 中的 uint32 个数，最后一块可能不满
+ */
+static uint32_t meta_words_in(meta_array_t *m,uint32_t d){
+    uint32_t first = d * META_WORDS_PER_DISKBLOCK;
+    return m->nwords - first<META_WORDS_PER_DISKBLOCK ? m->nwords - first : META_WORDS_PER_DISKBLOCK;
+}
+
+/**
+ * @brief 整个 disk block（含校验和）是否全为0，即格式化后从未写过
+ */
+static int meta_block_is_zero(const uint32_t *buf){
+    for(size_t i=0;i<DEVICE_BLOCK_SIZE / sizeof(uint32_t);i++){
+        if(buf[i]!=0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief 确保第 word 个 uint32 所在的 disk block 已读入。可多线程调用；
+ *        读入的 disk block 不放入块缓存，之后只用内存中的副本
+ * @return 成功返回0,读失败返回-EIO，校验和不符返回-EUCLEAN
+ */
+static int meta_need(meta_array_t *m,uint32_t word){
+    uint32_t d = word / META_WORDS_PER_DISKBLOCK;
+    if(atomic_load(&m->loaded[d])){
+        return 0;
+    }
+    uint32_t buf[DEVICE_BLOCK_SIZE / sizeof(uint32_t)];
+    int r = 0;
+    pthread_mutex_lock(&meta_lock);
+    if(!atomic_load(&m->loaded[d])){
+        int cached;
+        if(disk_read_block_nofill(m->start+d,(char*)buf,&cached)<0){
+            r = -EIO;
+        } else if(csum && buf[META_WORDS_PER_DISKBLOCK]!=block_csum(m->start+d,(char*)buf,META_WORDS_PER_DISKBLOCK*sizeof(uint32_t))
+                  && !meta_block_is_zero(buf)){
+            r = -EUCLEAN;
+        } else {
+            memcpy(m->words + d * META_WORDS_PER_DISKBLOCK,buf,meta_words_in(m,d) * sizeof(uint32_t));
+            atomic_store(&m->loaded[d],1);
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return r;
+}
+
+/**
+ * @brief 读入整个数组，只在需要遍历整个位图时使用（创建快照）
+ * @return 成功返回0,失败返回负的错误码
+ */
+static int meta_need_all(meta_array_t *m){
+    for(uint32_t d=0;d<m->ndisk;d++){
+        int r = meta_need(m,d * META_WORDS_PER_DISKBLOCK);
+        if(r<0){
+            return r;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 记下第 word 个 uint32 所在的 disk block 已被修改，该块须已读入
+ */
+static void meta_mark(meta_array_t *m,uint32_t word){
+    uint32_t d = word / META_WORDS_PER_DISKBLOCK;
+    if(!m->is_dirty[d]){
+        m->is_dirty[d] = 1;
+        m->dirty[m->ndirty++] = d;
+    }
+}
+
+static void meta_mark_all(meta_array_t *m){
+    for(uint32_t w=0;w<m->nwords;w+=META_WORDS_PER_DISKBLOCK){
+        meta_mark(m,w);
+    }
+}
+
+/**
+ * @brief 把被修改过的 disk block 写进disk，开启元数据校验时填写每块末尾的校验和
+ * @return 成功返回0,失败返回-1（未写成功的块仍记为已修改）
+ */
+static int meta_sync(meta_array_t *m){
+    uint32_t buf[DEVICE_BLOCK_SIZE / sizeof(uint32_t)];
+    while(m->ndirty>0){
+        uint32_t d = m->dirty[m->ndirty-1];
+        memset(buf,0,sizeof(buf));
+        memcpy(buf,m->words + d * META_WORDS_PER_DISKBLOCK,meta_words_in(m,d) * sizeof(uint32_t));
+        if(csum){
+            buf[META_WORDS_PER_DISKBLOCK] = block_csum(m->start+d,(char*)buf,META_WORDS_PER_DISKBLOCK*sizeof(uint32_t));
+        }
+        if(disk_write_block(m->start+d,(char*)buf)<0){
+            return -1;
+        }
+        m->is_dirty[d] = 0;
+        m->ndirty--;
+    }
+    return 0;
+}
+
+/**
+ * @brief 位图 m 的第 i 位，所在的 disk block 尚未读入时先读入。可多线程调用
+ * @return 置位返回1，否则返回0，读入失败返回负的错误码
+ */
+static int map_test(meta_array_t *m,uint32_t i){
+    int r = meta_need(m,i/32);
+    if(r<0){
+        return r;
+    }
+    return (m->words[i/32] & (0x80000000 >> (i%32))) != 0;
+}
+
+/*
+ * map_set / map_clear 只用于已读入的 disk block：分配到的位来自空闲区间索引，其所在块在加入索引时已读入；
+ * 释放前由 map_test 读入
+ */
+static void map_set(meta_array_t *m,uint32_t i){
+    m->words[i/32] |= (0x80000000 >> (i%32));
+    meta_mark(m,i/32);
+}
+
+static void map_clear(meta_array_t *m,uint32_t i){
+    m->words[i/32] &= ~(0x80000000 >> (i%32));
+    meta_mark(m,i/32);
+}
+
+static void meta_free_all(){
+    meta_free(&bmap);
+    meta_free(&imap);
+    meta_free(&itinit);
+    meta_free(&icsum);
+}
+
+/**
+ * @brief 按 fs_layout 为各元数据数组分配内存，未开启元数据校验时不需要 icsum。
+ *        loaded 为1时各数组视为已读入（格式化），否则用到时才读入
+ * @return 成功返回0,内存不足返回-ENOMEM
+ */
+static int meta_setup(int loaded){
+    if(meta_alloc(&bmap,fs_layout.bmap_start,bitmap_words(fs_layout.nblocks),loaded)<0
+        || meta_alloc(&imap,fs_layout.imap_start,bitmap_words(fs_layout.ninodes),loaded)<0
+        || meta_alloc(&itinit,fs_layout.itinit_start,bitmap_words(fs_layout.n_inode_block),loaded)<0
+        || (csum && meta_alloc(&icsum,fs_layout.icsum_start,fs_layout.n_inode_block*NDISKBLOCK_PER_DATABLOCK,loaded)<0)){
+        meta_free_all();
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+#define META_BITS_PER_DISKBLOCK (META_WORDS_PER_DISKBLOCK * 32)
+
+/**
+ * @brief 把位图 m（共 nbits 位）第 d 个 disk block 中的空闲位加入索引 x，已加入的不重复加入
+ * @return 成功返回0,读入失败或内存不足返回负的错误码
+ */
+static int index_group(meta_array_t *m,extent_index_t *x,uint32_t nbits,uint32_t d){
+    if(d>=m->ndisk || m->indexed[d]){
+        return 0;
+    }
+    int r = meta_need(m,d * META_WORDS_PER_DISKBLOCK);
+    if(r<0){
+        return r;
+    }
+    uint64_t end = (uint64_t)(d+1) * META_BITS_PER_DISKBLOCK;
+    if(extent_add_map(x,m->words,d * META_BITS_PER_DISKBLOCK,end<nbits ? end : nbits)<0){
+        return -ENOMEM;     // 索引已被丢弃，下次从头开始
+    }
+    m->indexed[d] = 1;
+    return 0;
+}
+
+/**
+ * @brief 确保空闲区间索引 x（对应位图 m，共 nbits 位）中至少有 n 个空闲位：
+ *        先加入 goal 所在的及其后一个 disk block，使追加的块能与前面的连续，
+ *        再从前往后依次加入尚未加入的 disk block，直到够用为止。
+ *        位图只在加入索引时读入，分配只读入用到的那部分
+ * @return 成功返回0，整个位图中都不够时返回-ENOSPC，读入失败或内存不足返回负的错误码
+ */
+static int index_ensure(meta_array_t *m,extent_index_t *x,uint32_t nbits,uint32_t goal,uint32_t n){
+    if(!extent_ready(x)){       // 尚未建立或因内存不足被丢弃，从头开始
+        memset(m->indexed,0,m->ndisk);
+        m->scan = 0;
+    }
+    int r = 0;
+    if(goal!=0){
+        r = index_group(m,x,nbits,goal / META_BITS_PER_DISKBLOCK);
+        if(r==0){
+            r = index_group(m,x,nbits,goal / META_BITS_PER_DISKBLOCK + 1);
+        }
+    }
+    while(r==0 && x->nfree<n && m->scan<m->ndisk){
+        r = index_group(m,x,nbits,m->scan++);
+    }
+    if(r<0){
+        return r;
+    }
+    return x->nfree>=n ? 0 : -ENOSPC;
+}
+
+/**
+ * @brief 元数据数组占用的数据块数
+ */
+static uint64_t meta_blocks(uint32_t nwords){
+    return (meta_disk_blocks(nwords) + NDISKBLOCK_PER_DATABLOCK - 1) / NDISKBLOCK_PER_DATABLOCK;
+}
+
+/**
+ * @brief 由块数和inode数算出各区域的位置，存入 fs_layout
+ * @return 成功返回0，参数不合法或 image 放不下元数据返回-1
+ */
+static int layout_init(uint32_t nblocks,uint32_t ninodes){
+    layout_t l;
+    if(ninodes==0 || ninodes%INODES_PER_BLOCK!=0 || ninodes>MAX_INODE_NUM){
+        return -1;
+    }
+    l.nblocks = nblocks;
+    l.ninodes = ninodes;
+    l.n_inode_block = ninodes / INODES_PER_BLOCK;
+    uint64_t next = 1;      // block 0 为 super block
+    l.bmap_start = next;
+    next += meta_blocks(bitmap_words(nblocks));
+    l.imap_start = next;
+    next += meta_blocks(bitmap_words(ninodes));
+    l.itinit_start = next;
+    next += meta_blocks(bitmap_words(l.n_inode_block));
+    l.icsum_start = next;
+    next += meta_blocks(l.n_inode_block * NDISKBLOCK_PER_DATABLOCK);
+    l.itable_start = next;
+    next += l.n_inode_block;
+    if(next + 1>=nblocks){  // 根目录块之外至少还要有一个数据块
+        return -1;
+    }
+    l.root_block = next;
+    l.n_meta_block = next + 1;
+    fs_layout = l;
+    return 0;
+}
+
+
+
+/**
+ * @brief 根据 inode_id 获取 disk block 的 id
+ * @return 成功返回disk block 的 id，失败返回 -1
+ */
+int get_disk_id_inode(uint32_t inode_id){
+    if(inode_id>=fs_layout.ninodes){
+        return -1;
+    } else {
+        return inode_disk_block(inode_id);
+    }
+};
+
+/**
+ * @brief 根据inode id 读取inode
+ * @return inode 指针,读取失败则返回NULL
+ */
+inode_t* read_inode(uint32_t inode_id){
+    char *buf = disk_block_buf;
+    int disk_block_id = get_disk_id_inode(inode_id);
+    if(disk_block_id<0 || itable_read(disk_block_id,buf)<0){
+        return NULL;
+    }
+    uint32_t offset = inode_disk_offset(inode_id);
+    memcpy((char*)&inode_buf,(char*)&disk_block_buf[offset],sizeof(inode_buf));
+    return (inode_t*)&disk_block_buf[offset];
+    // return &inode_buf;
+};
+
+/**
+ * @brief 读super_block：挂载时读入 sp_block_buf，之后以它为准
+ * @return super block buf指针
+ */
+sp_block_t* read_spblock(){
+    return (sp_block_t*)sp_block_buf;
+}
+
+/**
+ * @brief 将 block_id 号块读入调用者提供的 buf，不使用全局缓冲，可多线程调用
+ * @return 成功返回0,失败返回-1
+ */
+int load_block(uint32_t block_id,char *buf){
+    for(int i=0;i<NDISKBLOCK_PER_DATABLOCK;i++){
+        if(disk_read_block(block_disk_block(block_id)+i,buf)<0){
+            return -1;
+        }
+        buf += DEVICE_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * @brief 将 buf 写入 block_id 号块，可多线程调用
+ * @return 成功返回0,失败返回-1
+ */
+int store_block(uint32_t block_id,char *buf){
+    for(int i=0;i<NDISKBLOCK_PER_DATABLOCK;i++){
+        if(disk_write_block(block_disk_block(block_id)+i,buf)<0){
+            return -1;
+        }
+        buf += DEVICE_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+typedef struct inode_ref {          // 批量读写inode时用于排序
+    uint32_t inode_id;
+    int index;                      // 在调用者数组中的下标
+} inode_ref_t;
+
+static int cmp_inode_ref(const void *a,const void *b){
+    uint32_t x = ((const inode_ref_t*)a)->inode_id;
+    uint32_t y = ((const inode_ref_t*)b)->inode_id;
+    return x<y ? -1 : (x>y);
+}
+
+static inode_ref_t* sort_inode_ids(uint32_t *ids,int n){
+    inode_ref_t *refs = (inode_ref_t*)malloc(sizeof(inode_ref_t) * (n>0 ? n : 1));
+    if(refs==NULL){
+        return NULL;
+    }
+    for(int i=0;i<n;i++){
+        refs[i].inode_id = ids[i];
+        refs[i].index = i;
+    }
+    qsort(refs,n,sizeof(inode_ref_t),cmp_inode_ref);
+    return refs;
+}
+
+/*
+ * inode缓存：所有线程共享，内容与磁盘上的inode表一致。
+ * 直接映射：inode_id 只能放在第 inode_id % ICACHE_SIZE 项，由 icache_tag 记下该项实际存放的inode，
+ * 查找和填充都是常数时间，占用的内存与inode总数无关。
+ * 读inode表块时把块中的全部inode放入缓存，写inode表块成功后同步更新缓存。
+ * 元数据数组 itinit 和 icsum 也可能被 load_inodes 并发读取，同样由 icache_lock 保护
+ */
+#define ICACHE_SIZE 65536           // 2的幂
+
+static inode_t icache[ICACHE_SIZE];
+static uint32_t icache_tag[ICACHE_SIZE];    // 存放的 inode_id + 1，为0表示空
+static pthread_rwlock_t icache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int icache_get(uint32_t inode_id,inode_t *out){
+    int hit = 0;
+    uint32_t slot = inode_id % ICACHE_SIZE;
+    pthread_rwlock_rdlock(&icache_lock);
+    if(icache_tag[slot]==inode_id+1){
+        *out = icache[slot];
+        hit = 1;
+    }
+    pthread_rwlock_unlock(&icache_lock);
+    return hit;
+}
+
+/**
+ * @brief 用 disk block disk_id（inode表块）的内容 buf 更新缓存
+ */
+static void icache_fill(int disk_id,const char *buf){
+    uint32_t first = disk_block_first_inode(disk_id);
+    pthread_rwlock_wrlock(&icache_lock);
+    for(uint32_t i=0;i<INODES_PER_DISKBLOCK && first+i<fs_layout.ninodes;i++){
+        uint32_t slot = (first+i) % ICACHE_SIZE;
+        memcpy(&icache[slot],&buf[i*INODE_SIZE],sizeof(inode_t));
+        icache_tag[slot] = first+i+1;
+    }
+    pthread_rwlock_unlock(&icache_lock);
+}
+
+static void icache_clear(){
+    pthread_rwlock_wrlock(&icache_lock);
+    memset(icache_tag,0,sizeof(icache_tag));
+    pthread_rwlock_unlock(&icache_lock);
+}
+
+/**
+ * @brief disk_id 号 disk block 属于inode表中的第几块
+ */
+static int itable_index(int disk_id){
+    return (disk_id - block_disk_block(fs_layout.itable_start)) / NDISKBLOCK_PER_DATABLOCK;
+}
 
+/**
+ * @return 未初始化返回1，已初始化返回0，读入 itinit 失败返回负的错误码
+ */
+static int itable_is_uninit(int disk_id){
+    int i = itable_index(disk_id);
+    pthread_rwlock_rdlock(&icache_lock);
+    int r = map_test(&itinit,i);
+    pthread_rwlock_unlock(&icache_lock);
+    return r<0 ? r : !r;
+}
+
+/**
+ * @brief 读inode表中的 disk_id 号 disk block，未初始化的块不读磁盘，视为全0
+ *        开启元数据校验时，从磁盘读入的块核对校验和之后才放入块缓存，
+ *        块缓存中的块已经核对过（或由本文件系统写入），不再重复计算
+ * @return 成功返回0,失败或校验和不符返回-1
+ */
+static int itable_read(int disk_id,char *buf){
+    int u = itable_is_uninit(disk_id);
+    if(u<0){
+        return -1;
+    }
+    if(u){
+        memset(buf,0,DEVICE_BLOCK_SIZE);
+        return 0;
+    }
+    if(!csum){
+        return disk_read_block(disk_id,buf);
+    }
+    int cached;
+    if(disk_read_block_nofill(disk_id,buf,&cached)<0){
+        return -1;
+    }
+    if(!cached){
+        uint32_t d = disk_id - block_disk_block(fs_layout.itable_start);
+        if(meta_need(&icsum,d)<0){
+            return -1;
+        }
+        pthread_rwlock_rdlock(&icache_lock);
+        uint32_t want = icsum.words[d];
+        pthread_rwlock_unlock(&icache_lock);
+        if(block_csum(disk_id,buf,DEVICE_BLOCK_SIZE)!=want){
+            return -1;
+        }
+        disk_fill_block(disk_id,buf);
+    }
+    return 0;
+}
+
+/**
+ * @brief 写入inode表中的 disk_id 号 disk block 之后调用，更新它的校验和。只能在主线程调用；
+ *        icsum 中对应的 disk block 已由 itable_prepare 读入
+ */
+static void itable_csum_update(int disk_id,const char *buf){
+    if(!csum){
+        return;
+    }
+    uint32_t c = block_csum(disk_id,buf,DEVICE_BLOCK_SIZE);
+    uint32_t d = disk_id - block_disk_block(fs_layout.itable_start);
+    pthread_rwlock_wrlock(&icache_lock);
+    icsum.words[d] = c;
+    meta_mark(&icsum,d);
+    pthread_rwlock_unlock(&icache_lock);
+}
+
+/**
+ * @brief 写inode表中的 disk_id 号 disk block 之前调用：读入将要修改的 itinit 和 icsum 部分；
+ *        所在的块尚未初始化时，将块中其余的 disk block 清零，并在 itinit 中标记为已初始化。只能在主线程调用
+ * @return 成功返回0,失败返回-1
+ */
+static int itable_prepare(int disk_id){
+    int i = itable_index(disk_id);
+    int first = block_disk_block(fs_layout.itable_start + i);
+    for(int d=first;csum && d<first+NDISKBLOCK_PER_DATABLOCK;d++){
+        if(meta_need(&icsum,d - block_disk_block(fs_layout.itable_start))<0){
+            return -1;
+        }
+    }
+    int u = itable_is_uninit(disk_id);
+    if(u<=0){
+        return u;
+    }
+    char zero[DEVICE_BLOCK_SIZE];
+    memset(zero,0,sizeof(zero));
+    for(int d=first;d<first+NDISKBLOCK_PER_DATABLOCK;d++){
+        if(d!=disk_id && disk_write_block(d,zero)<0){
+            return -1;
+        }
+    }
+    pthread_rwlock_wrlock(&icache_lock);
+    map_set(&itinit,i);
+    for(int d=first;csum && d<first+NDISKBLOCK_PER_DATABLOCK;d++){
+        uint32_t k = d - block_disk_block(fs_layout.itable_start);
+        icsum.words[k] = block_csum(d,zero,DEVICE_BLOCK_SIZE);
+        meta_mark(&icsum,k);
+    }
+    pthread_rwlock_unlock(&icache_lock);
+    return 0;
+}
+
+/**
+ * @brief 批量读inode：先查inode缓存，未命中的按inode号排序后按inode表块分组，
+ *        每个inode表块只读一次，且按物理顺序读取。可多线程调用
+ * @param ids 要读的inode号，out[i] 存放 ids[i] 对应的inode
+ * @return 成功返回0,失败返回-1
+ */
+int load_inodes(uint32_t *ids,int n,inode_t *out){
+    char buf[DEVICE_BLOCK_SIZE];
+    if(n==1 && icache_get(ids[0],&out[0])){
+        return 0;
+    }
+    inode_ref_t *refs = sort_inode_ids(ids,n);
+    if(refs==NULL){
+        return -1;
+    }
+    int cur = -1;
+    for(int i=0;i<n;i++){
+        int disk_id = get_disk_id_inode(refs[i].inode_id);
+        if(disk_id<0){
+            free(refs);
+            return -1;
+        }
+        if(icache_get(refs[i].inode_id,&out[refs[i].index])){
+            continue;
+        }
+        if(disk_id!=cur){
+            if(itable_read(disk_id,buf)<0){
+                free(refs);
+                return -1;
+            }
+            icache_fill(disk_id,buf);
+            cur = disk_id;
+        }
+        memcpy(&out[refs[i].index],&buf[inode_disk_offset(refs[i].inode_id)],sizeof(inode_t));
+    }
+    free(refs);
+    return 0;
+}
+
+/**
+ * @brief 批量写inode：同一个inode表块中的inode合并为一次读改写
+ * @return 成功返回0,失败返回-1
+ */
+int store_inodes(uint32_t *ids,int n,inode_t *inodes){
+    char buf[DEVICE_BLOCK_SIZE];
+    inode_ref_t *refs = sort_inode_ids(ids,n);
+    if(refs==NULL){
+        return -1;
+    }
+    int i = 0;
+    while(i<n){
+        int disk_id = get_disk_id_inode(refs[i].inode_id);
+        if(disk_id<0 || itable_read(disk_id,buf)<0){
+            free(refs);
+            return -1;
+        }
+        for(;i<n && get_disk_id_inode(refs[i].inode_id)==disk_id;i++){
+            memcpy(&buf[inode_disk_offset(refs[i].inode_id)],&inodes[refs[i].index],sizeof(inode_t));
+        }
+        if(itable_prepare(disk_id)<0 || disk_write_block(disk_id,buf)<0){
+            free(refs);
+            return -1;
+        }
+        itable_csum_update(disk_id,buf);
+        icache_fill(disk_id,buf);
+    }
+    free(refs);
+    return 0;
+}
+
+/**
+ * @brief inode 占用的数据块数
+ */
+int inode_nblock(inode_t *inode){
+    return (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * @brief 读目录块,将block_id号对应的block读出到block_buf中
+ * @return 成功返回block中第一条目录项的指针，失败返回NULL
+ */
+dir_item_t* read_dir_block(uint32_t block_id){
+    if(load_dir_block(block_id,block_buf)<0){
+        return NULL;
+    }
+    return (dir_item_t*)block_buf;
+}
+
+
+int write_spblock();
+int write_inode();
+
+/**
+ * @brief 写inode，即将disk block buf内容写进disk
+ *        执行此函数之前需要read_inode
+ * @return 成功返回0,失败返回-1
+ */
+int write_inode(uint32_t inode_id){
+    int disk_id = get_disk_id_inode(inode_id);
+    if(itable_prepare(disk_id)<0 || disk_write_block(disk_id,disk_block_buf)<0){
+        return -1;
+    }
+    itable_csum_update(disk_id,disk_block_buf);
+    icache_fill(disk_id,disk_block_buf);
+    return 0;
+};
+
+/**
+ * @brief 写目录块:将block_buf写入磁盘。执行此函数之前需要read_dir_block
+ * @return 成功返回0,失败返回-1
+ */
+int write_dir_block(uint32_t block_id){
+    return store_dir_block(block_id,block_buf);
+}
+
+/**
+ * @brief 写super_block：只标记 sp_block_buf 已修改，由 sync_spblock 在操作结束时写进disk，
+ *        一个操作中多次修改 super block 只写一次、只计算一次校验和
+ * @return 成功返回0,失败返回-1
+ */
+int write_spblock(){
+    sp_dirty = 1;
+    return 0;
+};
+
+int spblock_pending(){
+    return sp_dirty || bmap.ndirty || imap.ndirty || itinit.ndirty || icsum.ndirty;
+}
+
+int sync_spblock(){
+    if(!spblock_pending()){
+        return 0;
+    }
+    if(meta_sync(&bmap)<0 || meta_sync(&imap)<0){
+        return -1;
+    }
+    pthread_rwlock_rdlock(&icache_lock);
+    int r = (meta_sync(&itinit)<0 || meta_sync(&icsum)<0) ? -1 : 0;
+    pthread_rwlock_unlock(&icache_lock);
+    if(r<0 || !sp_dirty){
+        return r;
+    }
+    sp_block_t *sp_block = read_spblock();
+    if(csum){
+        sp_block->checksum = sp_csum(sp_block);
+    }
+    if(disk_write_block(0,sp_block_buf)<0){     // sp_dirty 保持为1，下次重试
+        return -1;
+    }
+    sp_dirty = 0;
+    return 0;
+}
+
+
+/**
+ * @brief 检查是否有重复名字
+ * @return 如果有重复名字，返回重复的 （-inode_id）
+ *         没有则返回最后一个遍历到的dir_item
+ */
+int check_dup_name(char *tmp,int inode_id,int type){
+    // int i,j;
+    // inode
+}
+
+/**
+ * @brief 目录块中可以放目录项的字节数，开启元数据校验时要留出 dir_tail_t
+ */
+int dir_block_size(){
+    return csum ? BLOCK_SIZE - DIR_TAIL_SIZE : BLOCK_SIZE;
+}
+
+/**
+ * @brief 把目录块初始化为一条覆盖整个块的空闲记录
+ */
+void dir_block_init(char *block){
+    memset(block,0,BLOCK_SIZE);
+    ((dir_item_t*)block)->rec_len = dir_block_size();
+}
+
+/**
+ * @brief 开启元数据校验时，在目录块尾部填写 dir_tail_t
+ */
+static void dir_block_csum_set(char *block,uint32_t block_id){
+    if(!csum){
+        return;
+    }
+    dir_tail_t *tail = (dir_tail_t*)(block + BLOCK_SIZE - DIR_TAIL_SIZE);
+    tail->inode_id = 0;
+    tail->rec_len = DIR_TAIL_SIZE;
+    tail->name_len = 0;
+    tail->type = DIR_TAIL_TYPE;
+    tail->csum = block_csum(block_id,block,BLOCK_SIZE - DIR_TAIL_SIZE);
+}
+
+static int dir_block_csum_ok(const char *block,uint32_t block_id){
+    if(!csum){
+        return 1;
+    }
+    const dir_tail_t *tail = (const dir_tail_t*)(block + BLOCK_SIZE - DIR_TAIL_SIZE);
+    return tail->rec_len==DIR_TAIL_SIZE && tail->type==DIR_TAIL_TYPE
+        && tail->csum==block_csum(block_id,block,BLOCK_SIZE - DIR_TAIL_SIZE);
+}
+
+/**
+ * @brief 读目录块到调用者提供的 buf，可多线程调用
+ *        开启元数据校验时，只要有 disk block 是从磁盘读入的就核对校验和，核对通过后才放入块缓存
+ * @return 成功返回0,失败或校验和不符返回-1
+ */
+int load_dir_block(uint32_t block_id,char *buf){
+    if(!csum){
+        return load_block(block_id,buf);
+    }
+    int all_cached = 1;
+    for(int i=0;i<NDISKBLOCK_PER_DATABLOCK;i++){
+        int cached;
+        if(disk_read_block_nofill(block_disk_block(block_id)+i,buf+i*DEVICE_BLOCK_SIZE,&cached)<0){
+            return -1;
+        }
+        all_cached &= cached;
+    }
+    if(all_cached){
+        return 0;
+    }
+    if(!dir_block_csum_ok(buf,block_id)){
+        return -1;
+    }
+    for(int i=0;i<NDISKBLOCK_PER_DATABLOCK;i++){
+        disk_fill_block(block_disk_block(block_id)+i,buf+i*DEVICE_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/**
+ * @brief 写目录块，开启元数据校验时先填写校验和
+ * @return 成功返回0,失败返回-1
+ */
+int store_dir_block(uint32_t block_id,char *buf){
+    dir_block_csum_set(buf,block_id);
+    return store_block(block_id,buf);
+}
+
+/**
+ * @brief 在一个目录块中查找名为 name 的目录项
+ * @return 找到返回该目录项的指针，否则返回NULL
+ */
+dir_item_t* dir_block_find(char *block,const char *name){
+    size_t len = strlen(name);
+    uint32_t off = 0;
+    uint32_t end = dir_block_size();
+    while(off<end){
+        dir_item_t *item = (dir_item_t*)(block+off);
+        if(item->rec_len==0){   // 块已损坏，避免死循环
+            break;
+        }
+        if(item->name_len==len && !memcmp(item->name,name,len)){
+            return item;
+        }
+        off += item->rec_len;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在目录块中插入一条目录项：
+ *        依次检查每条记录尾部的空闲空间（rec_len 减去实际占用），
+ *        足够则把这段空间切出来作为新记录
+ * @return 成功返回0，块内空间不足返回-1
+ */
+int dir_block_insert(char *block,const char *name,uint32_t inode_id,uint8_t type){
+    size_t len = strlen(name);
+    uint16_t need = DIR_REC_LEN(len);
+    uint32_t off = 0;
+    uint32_t end = dir_block_size();
+    if(len==0 || len>DIR_NAME_MAX){
+        return -1;
+    }
+    while(off<end){
+        dir_item_t *item = (dir_item_t*)(block+off);
+        if(item->rec_len==0){
+            return -1;
+        }
+        uint16_t used = item->name_len ? DIR_REC_LEN(item->name_len) : 0;
+        if(item->rec_len - used >= need){
+            if(used){   // 从当前记录尾部切出新记录
+                dir_item_t *new_item = (dir_item_t*)((char*)item+used);
+                new_item->rec_len = item->rec_len - used;
+                item->rec_len = used;
+                item = new_item;
+            }
+            item->inode_id = inode_id;
+            item->name_len = len;
+            item->type = type;
+            memcpy(item->name,name,len);
+            return 0;
+        }
+        off += item->rec_len;
+    }
+    return -1;
+}
 
 /**
- * @brief 根据 inode_id 获取 disk block 的 id
- * @return 成功返回disk block 的 id，失败返回 -1
+ * @brief 删除目录块中名为 name 的目录项，原地并入前一条记录；
+ *        若它是块中第一条记录，则将其标记为空闲记录
+ * @return 成功返回0，找不到返回-1
  */
-int get_disk_id_inode(uint32_t inode_id){
-    if(inode_id>1024){
-        return -1;
-    } else {
-        return (2 + inode_id / 16);
+int dir_block_remove(char *block,const char *name){
+    size_t len = strlen(name);
+    dir_item_t *prev = NULL;
+    uint32_t off = 0;
+    uint32_t end = dir_block_size();
+    while(off<end){
+        dir_item_t *item = (dir_item_t*)(block+off);
+        if(item->rec_len==0){
+            break;
+        }
+        if(item->name_len==len && !memcmp(item->name,name,len)){
+            if(prev){
+                prev->rec_len += item->rec_len;
+            } else {
+                item->name_len = 0;
+                item->inode_id = 0;
+            }
+            return 0;
+        }
+        prev = item;
+        off += item->rec_len;
     }
-};
+    return -1;
+}
 
 /**
- * @brief 根据 inode_id 获取 disk block 的 id
- * @return 成功返回disk block 的 id，失败返回 -1
+ * @brief 在目录 dir_id 中查找名为 name 的目录项，使用局部缓冲，可多线程调用
+ * @return 找到返回其 inode_id，并通过 type 返回其类型；
+ *         找不到返回-ENOENT，读失败返回-EIO
  */
-int get_disk_id_data(uint32_t block_point){
-    if(block_point > 4063){
-        return -1;
-    } else {
-        return (66 + block_point * 2);
+int dir_lookup(uint32_t dir_id,const char *name,uint8_t *type){
+    char buf[BLOCK_SIZE];
+    inode_t dir;
+    if(load_inodes(&dir_id,1,&dir)<0){
+        return -EIO;
     }
-};
+    for(int k=0;k<dir.size/BLOCK_SIZE;k++){
+        if(load_dir_block(dir.block_point[k],buf)<0){
+            return -EIO;
+        }
+        dir_item_t *item = dir_block_find(buf,name);
+        if(item){
+            if(type){
+                *type = item->type;
+            }
+            return item->inode_id;
+        }
+    }
+    return -ENOENT;
+}
+
+int alloc_block(uint32_t goal);
 
 /**
- * @brief 根据inode id 读取inode
- * @return inode 指针,读取失败则返回NULL
+ * @brief 向目录 dir_id 中加入一条目录项，优先放入已有目录块的空闲空间，
+ *        所有块都放不下时才为目录分配新块
+ * @return 成功返回0；目录已达最大块数返回-EFBIG，其余失败返回负的错误码
  */
-inode_t* read_inode(uint32_t inode_id){
-    char *buf = disk_block_buf;
-    uint32_t disk_block_id = 2 + inode_id / 16;
-    if(disk_read_block(disk_block_id,buf)<0){
-        return NULL;
+int dir_add_entry(uint32_t dir_id,const char *name,uint32_t inode_id,uint8_t type){
+    inode_t *inode = read_inode(dir_id);
+    if(inode==NULL){
+        return -EIO;
     }
-    uint32_t offset = (inode_id % 16);
-    memcpy((char*)&inode_buf,(char*)&disk_block_buf[offset*sizeof(inode_t)],sizeof(inode_buf));
-    return (inode_t*)&disk_block_buf[offset*sizeof(inode_t)];
-    // return &inode_buf;
-};
+    inode_t dir = *inode;
+    int nblock = dir.size/BLOCK_SIZE;
+    for(int k=0;k<nblock;k++){
+        if(read_dir_block(dir.block_point[k])==NULL){
+            return -EIO;
+        }
+        if(dir_block_insert(block_buf,name,inode_id,type)==0){
+            return write_dir_block(dir.block_point[k])<0 ? -EIO : 0;
+        }
+    }
+    if(nblock>=MAX_FILE_BLOCK_NUM){     // 目录已满
+        return -EFBIG;
+    }
+
+    int block_id = alloc_block(nblock>0 ? dir.block_point[nblock-1] + 1 : 0);
+    if(block_id<0){
+        return block_id;
+    }
+    uint32_t new_block = block_id;
+    dir_block_init(block_buf);
+    dir_block_insert(block_buf,name,inode_id,type);
+    if(write_dir_block(block_id)<0 || (inode = read_inode(dir_id))==NULL){
+        goto fail;
+    }
+    inode->block_point[nblock] = block_id;
+    inode->size += BLOCK_SIZE;
+    if(write_inode(dir_id)<0){
+        goto fail;
+    }
+    return 0;
+fail:
+    // 新块没能挂到目录上，归还它
+    free_inodes_and_blocks(0,NULL,1,&new_block,0);
+    return -EIO;
+}
 
 /**
- * @brief 读super_block
- * @return 成功返回super block buf指针，失败返回NULL
+ * @brief 从目录 dir_id 中删除名为 name 的目录项
+ * @return 成功返回0,找不到返回-ENOENT，读写失败返回-EIO
  */
-sp_block_t* read_spblock(){
-    char *buf = (char *)sp_block_buf;
-    for(int i=0;i<2;i++){
-        if(disk_read_block(i,buf)<0){
-            return NULL;
+int dir_remove_entry(uint32_t dir_id,const char *name){
+    inode_t *inode = read_inode(dir_id);
+    if(inode==NULL){
+        return -EIO;
+    }
+    inode_t dir = *inode;
+    for(int k=0;k<dir.size/BLOCK_SIZE;k++){
+        if(read_dir_block(dir.block_point[k])==NULL){
+            return -EIO;
+        }
+        if(dir_block_remove(block_buf,name)==0){
+            return write_dir_block(dir.block_point[k])<0 ? -EIO : 0;
         }
-        buf += DEVICE_BLOCK_SIZE;
     }
-    return (sp_block_t*)sp_block_buf;
+    return -ENOENT;
 }
 
+
 /**
- * @brief 读dir_item,将block_id号对应的block读出到block_buf中
- * @return 成功返回block_buf指针（block中第一个dir_item的指针）
- *         失败返回NULL
+ * @brief 依次对目录 dir_id 中的每条有效目录项调用 fn，fn 返回非0时停止遍历
+ *        使用局部缓冲，可多线程调用
+ * @return 成功返回0（或 fn 的非0返回值），读失败返回-EIO
  */
-dir_item_t* read_dir_item(uint32_t block_id,uint16_t offset){
-    char *buf = (char*)block_buf;
-    for(int i=0;i<2;i++){
-        if(disk_read_block(block_id*2+i,buf)<0){
-            return NULL;
+int dir_iterate(uint32_t dir_id,int (*fn)(dir_item_t *item,void *arg),void *arg){
+    char buf[BLOCK_SIZE];
+    inode_t dir;
+    if(load_inodes(&dir_id,1,&dir)<0){
+        return -EIO;
+    }
+    if(dir.file_type!=TYPE_DIR){
+        return -ENOTDIR;
+    }
+    for(int k=0;k<dir.size/BLOCK_SIZE;k++){
+        if(load_dir_block(dir.block_point[k],buf)<0){
+            return -EIO;
+        }
+        uint32_t off = 0;
+        while(off<(uint32_t)dir_block_size()){
+            dir_item_t *item = (dir_item_t*)(buf+off);
+            if(item->rec_len==0){
+                break;
+            }
+            off += item->rec_len;
+            if(item->name_len==0){  // 空闲记录
+                continue;
+            }
+            int r = fn(item,arg);
+            if(r){
+                return r;
+            }
         }
-        buf += DEVICE_BLOCK_SIZE;
     }
-    return &block_buf[offset];
+    return 0;
 }
 
-
-int write_spblock();
-int write_inode();
+static int not_dot(dir_item_t *item,void *arg){
+    return !((item->name_len==1 && item->name[0]=='.')
+        || (item->name_len==2 && item->name[0]=='.' && item->name[1]=='.'));
+}
 
 /**
- * @brief 写inode，即将disk block buf内容写进disk
- *        同时更新 super block 的信息
- * @return 
+ * @brief 判断目录 dir_id 中是否只有 "." 和 ".."
+ * @return 为空返回1，不为空返回0，失败返回负的错误码
  */
-int write_inode(uint32_t inode_id){
-    //TODO 
-    // update disk
+int dir_is_empty(uint32_t dir_id){
+    int r = dir_iterate(dir_id,not_dot,NULL);
+    return r<0 ? r : !r;
+}
 
 
-    if(disk_write_block(get_disk_id_inode(inode_id),disk_block_buf)<0){
-        return -1;
+/**
+ * @brief 挂载已有的文件系统：核对 super block，按其中的几何参数为元数据数组分配内存
+ * @return 成功返回0,失败返回负的错误码
+ */
+static int load_filesystem(sp_block_t *sp_block){
+    csum = (sp_block->features & SP_FEATURE_CSUM) != 0;
+    if(csum && sp_block->checksum!=sp_csum(sp_block)){
+        return -EUCLEAN;
     }
-
-    sp_block_t* sp_block = read_spblock();
-    sp_block->free_block_count -= 1;
-    uint16_t index = inode_id / 32;
-    uint16_t offset = inode_id % 32;
-    uint32_t new_inode_map = sp_block->inode_map[index];
-    new_inode_map |= (0x80000000 >> offset);
-    sp_block->inode_map[index] = new_inode_map;        
-
-
-    //update spblock
-    if(write_spblock()<0){
-        return -1 ;
-    } 
-    return 0;
-};
+    if(sp_block->block_size!=BLOCK_SIZE || layout_init(sp_block->nblocks,sp_block->ninodes)<0
+        || sp_block->nblocks>disk_nblocks()/NDISKBLOCK_PER_DATABLOCK){
+        return -EINVAL;
+    }
+    return meta_setup(0);  // 元数据数组用到时才读入，挂载只读 super block
+}
 
 /**
- * @brief 写dir_item:将dir_item_buf的信息拷贝到block_buf
- *        然后将block_buf写入磁盘。执行此函数之前需要read_dir_item
- *        同时更新 super block 的信息
- * @return 
+ * @brief 格式化：块数由 image 的大小决定，inode数由 set_format 决定。
+ *        不写inode表，只写 super block、元数据数组、根inode所在的表块和根目录块
+ * @return 成功返回0,失败返回负的错误码
  */
-int write_dir_item(uint32_t block_point,uint16_t offset){
-    //TODO
-    // 将 dir_item_buf拷贝进block_buf
-    char *buf = (char*) block_buf;
-    memcpy(&block_buf[offset],&dir_item_buf,sizeof(dir_item_buf));
-    // printf("write_dir:\n,inode_id:%d,name:%s\n",((dir_item_t*)&block_buf[offset])->inode_id,((dir_item_t*)&block_buf[offset])->name);
-    for(int i=0;i<2;i++){
-        if(disk_write_block(block_point*2+i,buf)<0){
-            return -1;
+static int format_filesystem(sp_block_t *sp_block){
+    uint32_t nblocks = disk_nblocks() / NDISKBLOCK_PER_DATABLOCK;
+    uint64_t ninodes = format_ninodes;
+    if(ninodes==0){
+        ninodes = (uint64_t)nblocks * BLOCK_SIZE / BYTES_PER_INODE;
+        if(ninodes>MAX_INODE_NUM){
+            ninodes = MAX_INODE_NUM / INODES_PER_BLOCK * INODES_PER_BLOCK;
         }
-        buf+=DEVICE_BLOCK_SIZE;
     }
-    sp_block_t *sp_block = read_spblock();
-    sp_block->free_block_count -= 1;
-    uint16_t index = block_point / 32;
-    uint16_t offset_map = block_point % 32;
-    uint32_t new_block_map = sp_block->block_map[index];
-    new_block_map |= (0x80000000 >> offset_map);
-    sp_block->block_map[index] = new_block_map;
+    ninodes = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+    if(ninodes==0){
+        ninodes = INODES_PER_BLOCK;
+    }
+    if(ninodes>MAX_INODE_NUM || layout_init(nblocks,ninodes)<0){
+        return -EINVAL;
+    }
+    csum = format_csum;
+    int r = meta_setup(1);
+    if(r<0){
+        return r;
+    }
 
-    if(write_spblock()<0){
-        return -1;
+    memset(sp_block_buf,0,sizeof(sp_block_buf));
+    sp_block->magic_num = MAGICNUM;
+    sp_block->block_size = BLOCK_SIZE;
+    sp_block->nblocks = fs_layout.nblocks;
+    sp_block->ninodes = fs_layout.ninodes;
+    sp_block->features = format_csum ? SP_FEATURE_CSUM : 0;
+    sp_block->free_block_count = fs_layout.nblocks - fs_layout.n_meta_block; // super block, 元数据数组, inode 表和根目录块
+    sp_block->free_inode_count = fs_layout.ninodes - 1;
+    sp_block->dir_inode_count = 1;  // folder "root"
+    // image 中原有的内容不可信：在元数据数组所在的区域打洞，使其读出为全0（新建的 image 本来就是空洞），
+    // 之后只需写有非0内容的 disk block；inode表全部标为未初始化，不会被读取。
+    // 宿主不支持打洞时退回到把整个数组写一遍
+    uint32_t first = block_disk_block(fs_layout.bmap_start);
+    if(disk_discard_blocks(first,block_disk_block(fs_layout.itable_start) - first)<0){
+        meta_mark_all(&bmap);
+        meta_mark_all(&imap);
+        meta_mark_all(&itinit);
+        if(csum){
+            meta_mark_all(&icsum);
+        }
+    }
+    map_set(&imap,0);               // first inode "root"
+    uint32_t nword = fs_layout.n_meta_block / 32;   // 元数据区域的位先整字填充
+    memset(bmap.words,0xff,sizeof(uint32_t) * nword);
+    for(uint32_t w=0;w<nword;w+=META_WORDS_PER_DISKBLOCK){
+        meta_mark(&bmap,w);
+    }
+    for(uint32_t b=nword*32;b<fs_layout.n_meta_block;b++){
+        map_set(&bmap,b);
+    }
+    write_spblock();
+
+    inode_t* inode = read_inode(0);   // root inode
+    if(inode==NULL){
+        return -EIO;
+    }
+    memset(inode,0,sizeof(inode_t));
+    inode->file_type = TYPE_DIR;
+    inode->link = 2;
+    inode->block_point[0] = fs_layout.root_block;
+    inode->size = BLOCK_SIZE;
+    if(write_inode(0)<0){
+        return -EIO;
     }
 
+    dir_block_init(block_buf);  // init root dir_item
+    dir_block_insert(block_buf,".",0,TYPE_DIR);
+    dir_block_insert(block_buf,"..",0,TYPE_DIR);
+    if(write_dir_block(fs_layout.root_block)<0 || sync_spblock()<0){
+        return -EIO;
+    }
     return 0;
 }
 
 /**
- * @brief 写super_block，将sp_block_buf内容写进disk
- * @return 成功返回0,失败返回-1
+ * @brief 初始化文件系统
+ *        如果没有 image 文件，则按 set_format 设置的大小创建，创建失败返回 -EIO
+ *        如果有，则检查magic num，正确则说明已经初始化，否则进行初始化；
+ *        旧格式的 image 不会被覆盖，返回 -ENOTSUP
+ * @return 成功返回0,失败返回负的错误码
  */
-int write_spblock(){
-    char *buf = (char*)sp_block_buf;
-    for(int i=0;i<2;i++){
-        if(disk_write_block(i,buf)<0){
-            return -1;
-        }
-        buf += DEVICE_BLOCK_SIZE;
+int init_filesystem(const char *image){
+
+    icache_clear();     // 可能换了 image 或快照视图
+    extent_reset(&block_index);
+    extent_reset(&inode_index);
+    meta_free_all();
+    sp_dirty = 0;
+    if(disk_set_create_size(format_size)<0){
+        return -EINVAL;
+    }
+    if(open_disk_file(image)<0){
+        return -EIO;
     }
-    return 0;
-};
 
+    sp_block_t *sp_block = (sp_block_t*)sp_block_buf;
+    int r;
+    if(disk_read_block(0,sp_block_buf)<0){
+        r = -EIO;
+    } else if(sp_block->magic_num == MAGICNUM){ //disk 已经建立，挂载
+        r = load_filesystem(sp_block);
+    } else if(IS_LEGACY_MAGICNUM(sp_block->magic_num)){
+        r = -ENOTSUP;
+    } else {  // disk not initialized
+        r = format_filesystem(sp_block);
+    }
+    if(r<0){
+        meta_free_all();
+        sp_dirty = 0;
+        csum = 0;
+        close_disk();
+    }
+    return r;
+}
 
 /**
- * @brief 检查是否有重复名字
- * @return 如果有重复名字，返回重复的 （-inode_id）
- *         没有则返回最后一个遍历到的dir_item
+ * @brief 判断 inode_id 是否已被分配，查inode占用位图（所在的 disk block 尚未读入时先读入），可多线程调用
+ * @return 已分配返回1，未分配返回0，读入位图失败返回负的错误码
  */
-int check_dup_name(char *tmp,int inode_id,int type){
-    // int i,j;
-    // inode
+int inode_in_use(uint32_t inode_id){
+    if(inode_id>=fs_layout.ninodes){
+        return 0;
+    }
+    return map_test(&imap,inode_id);
 }
 
+/**
+ * @brief 批量分配：从空闲inode索引分配 ninode 个inode，从空闲区间索引分配 nblock 个数据块，
+ *        只写一次super block。索引中不够时先把更多的位图加入索引（见 index_ensure）
+ * @param goal 不为0时数据块优先从 goal 开始连续分配
+ * @param ndir 其中目录的个数，用于更新 dir_inode_count
+ * @return 成功返回0，空间不足返回-ENOSPC，读入位图失败返回-EIO或-EUCLEAN（此时都不做任何分配）
+ */
+static int alloc_near(int ninode,uint32_t *inodes,int nblock,uint32_t *blocks,int ndir,uint32_t goal){
+    sp_block_t *sp_block = read_spblock();
+    if(sp_block->free_inode_count<ninode || sp_block->free_block_count<nblock){
+        return -ENOSPC;
+    }
+    int r = 0;
+    if(ninode>0){
+        r = index_ensure(&imap,&inode_index,fs_layout.ninodes,0,ninode);
+    }
+    if(r==0 && nblock>0){
+        r = index_ensure(&bmap,&block_index,fs_layout.nblocks,goal,nblock);
+    }
+    if(r<0){
+        return r;
+    }
+    r = extent_alloc(&inode_index,0,ninode,inodes);
+    if(r<0){
+        return r;
+    }
+    r = extent_alloc(&block_index,goal,nblock,blocks);
+    if(r<0){
+        extent_reset(&inode_index);     // 已取出的inode尚未记入位图，下次重建
+        return r;
+    }
+    for(int i=0;i<ninode;i++){
+        map_set(&imap,inodes[i]);
+    }
+    for(int i=0;i<nblock;i++){
+        map_set(&bmap,blocks[i]);
+    }
+    sp_block->free_inode_count -= ninode;
+    sp_block->free_block_count -= nblock;
+    sp_block->dir_inode_count += ndir;
+    return write_spblock()<0 ? -EIO : 0;
+}
 
 /**
- * @brief 初始化文件系统
- *        如果没有disk，则创建，创建失败返回“open disk error！”
- *        如果有disk，则检查magic num，正确则说明已经初始化，否则进行初始化
+ * @brief 分配一个数据块，优先分配 goal 号块
+ * @return success: block_id, fail: 负的错误码
  */
-int init_filesystem(){
+int alloc_block(uint32_t goal){
+    uint32_t block_id;
+    int r = alloc_near(0,NULL,1,&block_id,0,goal);
+    return r<0 ? r : (int)block_id;
+}
 
-    if(open_disk()<0){
-        printf("open disk error!\n");
-        exit(0);
-    }
-    
-    sp_block_t* sp_block = read_spblock();
-    // printf("start:%.8x\n magic_num:%.8x\n",((sp_block_t*)sp_block_buf)->block_map[0],((sp_block_t*)sp_block_buf)->magic_num);
+int alloc_inodes_and_blocks(int ninode,uint32_t *inodes,int nblock,uint32_t *blocks,int ndir){
+    return alloc_near(ninode,inodes,nblock,blocks,ndir,0);
+}
 
-    if(sp_block->magic_num == MAGICNUM){ //disk 已经建立
-        return 0;
-    } else {  // disk not initialized
-        sp_block->magic_num = MAGICNUM;
-        sp_block->free_block_count = 4096 - 34; //1 for super block, 32 for inode, 1 for floder "root"
-        sp_block->free_inode_count = 1024 - 1; 
-        sp_block->dir_inode_count = 1;  // folder "root"
-        sp_block->inode_map[0] = (0x80000000); // first inode "root"
-        sp_block->block_map[0] = (0xffffffff); // 1 super block,31 inode;
-        sp_block->block_map[1] = (0xc0000000); // 1 inode, 1 for folder "root"
-        // printf("init:%.8x\n",((sp_block_t*)sp_block_buf)->block_map[0]);
-        write_spblock();
-        // read_spblock();
-        // printf("init:%.8x\n",((sp_block_t*)sp_block_buf)->block_map[0]);
-        
-        inode_t* inode = read_inode(0);   // root inode
-        inode->file_type = TYPE_DIR;
-        inode->link = 0;
-        inode->block_point[0]=33;   // 0 for super block, 1~32 for inode, 33 for root dir_item
-        inode->size = 1;
-        write_inode(0);
-
-        dir_item_buf.inode_id = 0;  // init root dir_item
-        strcpy(dir_item_buf.name,".");
-        dir_item_buf.type = TYPE_DIR;
-        dir_item_buf.valid = 1;
-        // memset(disk_block_buf,0,DEVICE_BLOCK_SIZE);
-        // dir_item_t* dir_item = (dir_item_t*)disk_block_buf;
-        // memcpy(dir_item,&dir_item_buf,sizeof(dir_item_buf));
-        // disk_write_block(66,(char*)disk_block_buf);
-        read_dir_item(33,0);
-        write_dir_item(33,0);
-
-        dir_item_t *dir_item = read_dir_item(33,0);
-        // disk_read_block(66,disk_block_buf);
-        // dir_item_t *dir_item = (dir_item_t*)disk_block_buf;
-        // printf("init:\n");
-        // printf("dir_item:\ninode_id:%d,name:%s\n",dir_item->inode_id,dir_item->name);
-        
-    }
-    return 0;
+static int cmp_block_id(const void *a,const void *b){
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x<y ? -1 : (x>y);
 }
 
 /**
- * @brief 从左到右，找到一个空闲的inode
- * @return success: inode_id, fail: -1
+ * @brief 把释放的数据块排序并合并成连续区间，逐段在宿主文件中打洞
+ *        打洞只是节省宿主空间，失败不影响文件系统本身
  */
-int get_free_inode(){
-    sp_block_t *sp_block = read_spblock();
-    if(sp_block->free_inode_count == 0){
-        printf("No free inode!\n");
-        return -1;
+void discard_blocks(uint32_t *blocks,int nblock){
+    uint32_t *sorted = (uint32_t*)malloc(sizeof(uint32_t) * (nblock>0 ? nblock : 1));
+    if(sorted==NULL){
+        return;
     }
-    for(int i=0;i<32;i++){
-        if(sp_block->inode_map[i]==0xffffffff)
-            continue;
-        uint32_t mask = 0x80000000;
-        //掩码从左到右寻找inode_map为0的位置
-        for(int j=0;j<32;j++){
-            if(mask & sp_block->inode_map[i])  //没有找到空闲位置，继续向右寻找
-                mask >>= 1;
-            else {  // 找到空闲,返回空闲inode,并且更新超级块
-                // sp_block->inode_map[i] |= mask;
-                return (i*32+j);
-            }
+    memcpy(sorted,blocks,sizeof(uint32_t) * nblock);
+    qsort(sorted,nblock,sizeof(uint32_t),cmp_block_id);
+    int i = 0;
+    while(i<nblock){
+        int j = i + 1;
+        while(j<nblock && sorted[j]==sorted[j-1]+1){
+            j++;
         }
+        disk_discard_blocks(block_disk_block(sorted[i]),(j-i)*NDISKBLOCK_PER_DATABLOCK);
+        i = j;
     }
-    return -1;
+    free(sorted);
+}
+
+void set_discard(int on){
+    discard = on;
+}
+
+void set_format_csum(int on){
+    format_csum = on;
+}
+
+void set_format(uint64_t size,uint64_t ninodes){
+    format_size = size;
+    format_ninodes = ninodes;
 }
 
 /**
- * @brief 从左到右，找到满足num要求的空闲block
- * @return success: block_id, fail: -1
+ * @brief 批量释放inode和数据块，只写一次super block
+ * @param ndir 其中目录的个数，用于更新 dir_inode_count
+ * @return 成功返回0,失败返回-EIO
  */
-int get_free_block(int block_num){
+int free_inodes_and_blocks(int ninode,uint32_t *inodes,int nblock,uint32_t *blocks,int ndir){
     sp_block_t *sp_block = read_spblock();
-    if(sp_block->free_block_count<block_num){ //如果剩余block不满足要申请的数目，直接返回-1
-        printf("No enough blocks \n");
-        return -1;
+    // 先读入涉及的位图，读入失败时不做任何修改
+    for(int i=0;i<ninode;i++){
+        if(inodes[i]<fs_layout.ninodes && map_test(&imap,inodes[i])<0){
+            return -EIO;
+        }
     }
-    
-    for(int i=0;i<128;i++){
-        if(sp_block->block_map[i]==(0xffffffff))
-            continue;
-        uint32_t mask  = 0x80000000;
-        // printf("get_free_block(),sp_block.block_map[%d]:0x%.8x\n",i,sp_block->block_map[i]);
-        for(int j=0;j<32;j++){
-            if((mask & sp_block->block_map[i])){ //没有找到空闲位置，继续向右寻找
-                mask >>= 1;
-            } else {
-                // sp_block->block_map[i] |= mask;
-                // sp_block->free_block_count --;
-                if(block_num == 0){
-                    return -1;
-                }
-                else {
-                    return (i*32+j);
-                }
+    for(int i=0;i<nblock;i++){
+        if(blocks[i]<fs_layout.nblocks && map_test(&bmap,blocks[i])<0){
+            return -EIO;
+        }
+    }
+    // 所在的 disk block 尚未加入空闲区间索引时只改位图，加入时自然会包含它们
+    for(int i=0;i<ninode;i++){
+        if(inodes[i]<fs_layout.ninodes && map_test(&imap,inodes[i])>0){
+            map_clear(&imap,inodes[i]);
+            sp_block->free_inode_count += 1;
+            if(extent_ready(&inode_index) && imap.indexed[inodes[i] / META_BITS_PER_DISKBLOCK]){
+                extent_free(&inode_index,inodes[i],1);
+            }
+        }
+    }
+    for(int i=0;i<nblock;i++){
+        if(blocks[i]<fs_layout.nblocks && map_test(&bmap,blocks[i])>0){
+            map_clear(&bmap,blocks[i]);
+            sp_block->free_block_count += 1;
+            if(extent_ready(&block_index) && bmap.indexed[blocks[i] / META_BITS_PER_DISKBLOCK]){
+                extent_free(&block_index,blocks[i],1);
             }
         }
     }
+    sp_block->dir_inode_count -= ndir;
+    if(write_spblock()<0){
+        return -EIO;
+    }
+    if(discard){
+        discard_blocks(blocks,nblock);
+    }
+    return 0;
 }
 
 /**
  * @brief mkdir，找到路径，并且tmp存储要创建的文件名
- * @return success: 最后一个目录的inode_id, fail: -1
+ * @return success: 最后一个目录的inode_id,
+ *         fail: 中间目录不存在返回-ENOENT，不是目录返回-ENOTDIR，名字过长返回-ENAMETOOLONG
  */
-int find_path_directory(char *path,char *tmp){
+int find_path_directory(const char *path,char *tmp){
     int inode_id = 0;
-    int i = 0;
-    int j = 0;
-    inode_t *inode;
-    if(path[0]=='/'){
-        inode_id = 0;
+    const char *p = path;
+    while(*p=='/'){
+        p++;
     }
     while(1){
-
-        if(path[i]!='/'){
-            tmp[j++] = path[i];
+        // 取出下一个路径分量放入tmp
+        int j = 0;
+        while(*p!='\0' && *p!='/'){
+            if(j>=DIR_NAME_MAX){
+                return -ENAMETOOLONG;
+            }
+            tmp[j++] = *p++;
         }
-
-        if(path[i]=='\0'){
+        tmp[j] = '\0';
+        while(*p=='/'){
+            p++;
+        }
+        if(*p=='\0'){   // tmp 为最后一个分量
             break;
         }
-        // mkdir /home/tmp 
-        if(path[i]=='/' && path[i+1]!='\0'){
-            tmp[j] = '\0';
-            j = 0;
-            int success = 0;
-            inode = read_inode(inode_id);
-            for(int k=0;k<inode->size;k++){
-                read_dir_item(inode->block_point[k],0);
-                    for(int p=0;p<8;p++){
-                        if(block_buf[p].type==TYPE_DIR \
-                            && !strcmp(tmp,block_buf[p].name) \
-                            && block_buf[p].valid)
-                        {
-                            k = 1024;
-                            inode_id = block_buf[p].inode_id;
-                            success = 1;
-                            break;
-                        }
-                        if(!block_buf[p].valid){
-                            success = 0;
-                            continue;
-                        }
-                    }
-            }
-            if(!success){
-                printf("No such directory \"%s\"\n",tmp);
-                return -1;
-            }
+        uint8_t type;
+        inode_id = dir_lookup(inode_id,tmp,&type);
+        if(inode_id<0){
+            return inode_id;
         }
-        if(path[i]=='/' && path[i+1]=='\0'){
-            tmp[j] = '\0';
-            break;
+        if(type!=TYPE_DIR){
+            return -ENOTDIR;
         }
-        i++;
     }
     return inode_id;
 }
@@ -364,286 +1414,270 @@ int find_path_file(char *path,char *tmp){
 
 }
 
-int exec_ls(char *argv[],int argc){
-    // printf(".\n..\n");
-    int i=0;
-    int j=0;
-    char tmp[MAXLINE];
-    inode_t *inode;
-    int inode_id = 0;
-    if(argc == 1 || (argc>1 && !strcmp(argv[1],"/"))){ //列举根目录下的文件、文件夹
-        // TODO
-        inode_id = 0;
-    } 
-    else {
-        char *path = argv[1];
-        // printf("ls:path: %s\n",path);
-        // 根据传进来的路径，找到对应目录
-        while(path[i]!='\0'){
-
-            if(path[i]!='/'){  //获取目录名
-                tmp[j++] = path[i];
-            }
-
-            if(path[i]=='/' || path[i+1]=='\0'){
-                tmp[j] = '\0';
-                // printf("ls:tmp:%s\n",tmp);
-                j=0;
-                int success = 0;
-                inode_t* inode = read_inode(inode_id);
-                // 
-                // printf("read_inode:\nsize:%d,type:%d,",inode->size,inode->file_type);
-                for(int k=0;k<inode->size;k++){
-                    // 读取inode的数据块
-                    read_dir_item(inode->block_point[k],0);
-                    for(int p=0;p<8;p++){
-                        // printf("read block point %d of inode %d:\n",k,inode_id);
-                        // printf("%d: type:%d,name: %s,valid:%d\n",p,block_buf[p].type,block_buf[p].name,block_buf[p].valid);
-                        if(block_buf[p].type==TYPE_DIR \
-                            && !strcmp(tmp,block_buf[p].name) \
-                            && block_buf[p].valid)
-                        {
-                            k = 1024;
-                            inode_id = block_buf[p].inode_id;
-                            success = 1;
-                            break;
-                        }
-                        if(!block_buf[p].valid){
-                            success = 0;
-                            continue;
-                        }
-                    }
-                }
-                if(!success){
-                    printf("Can not find directory %s \n",path);
-                    return -1;
-                }
-            }
-            i++;
-        }
-    }
-    // printf("ls(),inode_id:%d\n",inode_id);
-    inode = read_inode(inode_id);
-    // print size
-    // printf("inode_%d_size:%d\n",inode_id,inode->size);
-    for(int k=0;k<inode->size;k++){
-        read_dir_item(inode->block_point[k],0);
-        for(int j=0;j<8;j++){
-            if(block_buf[j].valid){
-                // printf("%s\n",block_buf[j].name);
-                if(*block_buf[j].name=='\0'){
-                    continue;
-                }
-                if((block_buf[j].type == TYPE_DIR) ) /// && (k!=0 && j!=0 && j!=1)) \\不为 .和..打印文件夹标志
-                {
-                    printf("[%s]\n",block_buf[j].name);
-                }
-                else{
-                    printf("%s\n",block_buf[j].name);
-                }
-            }
+/**
+ * @brief 找到路径本身对应的inode
+ * @return success: inode_id, fail: 负的错误码
+ */
+int find_path(const char *path,uint8_t *type){
+    char tmp[DIR_NAME_MAX + 1];
+    int dir_id = find_path_directory(path,tmp);
+    if(dir_id<0){
+        return dir_id;
+    }
+    if(tmp[0]=='\0'){   // 路径为 "/"
+        if(type){
+            *type = TYPE_DIR;
         }
+        return dir_id;
     }
+    return dir_lookup(dir_id,tmp,type);
 }
 
-int exec_mkdir(char *argv[],int argc){
-    if(argc<2){
-        printf("Too few arguments!\n");
-        return -1;
+/**
+ * @brief 将inode的连接数加上delta
+ * @return 成功返回0,失败返回-EIO
+ */
+int add_link(uint32_t inode_id,int delta){
+    inode_t *inode = read_inode(inode_id);
+    if(inode==NULL){
+        return -EIO;
     }
-    char tmp[MAXLINE];
-    char *path = argv[1];
-    uint32_t inode_id = find_path_directory(path,tmp);
-    // printf("find_path:path:%s,tmp:%s,inode_id:%d\n",path,tmp,inode_id);
-    inode_t* inode;
+    inode->link += delta;
+    return write_inode(inode_id)<0 ? -EIO : 0;
+}
 
-    if(inode_id <0 || tmp[0]=='\0'){
-        return -1;
+/**
+ * @brief mkdir和touch共用：在path的父目录中创建一个type类型的新项
+ *        目录会同时创建 "." 和 ".." 两个目录项
+ * @return success: 新项的inode_id, fail: 负的错误码
+ */
+int create_entry(const char *path,uint8_t type){
+    char tmp[DIR_NAME_MAX + 1];
+    int parent_id = find_path_directory(path,tmp);
+    if(parent_id<0){
+        return parent_id;
     }
-
-    // int i = check_dup_name(tmp,inode_id,TYPE_DIR);
-    inode = read_inode(inode_id);
-    // for(int j=0;j<6;j++){
-    //     // 只有根目录的block_point[0] = 0，其余block_point都不能为0 
-    //     // 否则视为该block_point是无效的,还没有指定
-    //     if(inode_id==0){
-    //         for(int k=0;k<inode->size;k++){
-    //             read_dir_item(inode->block_point[k]);
-    //             get_free_block(1)
-    //         }
-    //     }
-    // }
-    // printf("cur_dir:inode_id:%d,\n")
-
-    int block_id = get_free_block(1);
-    // inode_id = get_free_inode();
-
-    int success = 0;
-    for(int k=1;k<6;k++){
-        // TODO：这里只实现了每个文件夹下最多五个dir_item
-        if(inode->block_point[k]==0){ //未分配
-            // 直接分配
-            inode->block_point[k] = block_id;
-            inode->size++;
-            success = 1;
-            write_inode(inode_id);
-            break;
-        }
-        // else{
-        //     // 寻找一块空闲的dir_item空间，将其放入
-        // }
+    if(tmp[0]=='\0'){
+        return -EEXIST;
     }
-    if(!success){
-        printf("directory full!\n");
-        return -1;
+    int r = dir_lookup(parent_id,tmp,NULL);
+    if(r>=0){
+        return -EEXIST;
+    }
+    if(r!=-ENOENT){
+        return r;
     }
 
-    inode_id = get_free_inode();
-
-
-    dir_item_t* dir_item = read_dir_item(block_id,0);
-    dir_item_buf.inode_id = inode_id;
-    strcpy(dir_item_buf.name,tmp);
-    // printf("mkdir(),name:%s \nblock_point:%d\ninode_id:%d\n",dir_item_buf.name,block_id,inode_id);
-    dir_item_buf.type = TYPE_DIR;
-    dir_item_buf.valid = 1;
-    write_dir_item(block_id,1);
-    // read_spblock();
-    // printf("mkdir:block_map[1]:%.8x\n",((sp_block_t*)sp_block_buf)->block_map[1]);
-
-    inode = read_inode(inode_id);
-    inode->block_point[0] = 0;
-    inode->file_type = TYPE_DIR;
-    inode->link = 0;
-    inode->size += 1;
-    write_inode(inode_id);
+    // 新项的inode和目录块一次分配，失败时一次归还
+    uint32_t inode_id;
+    uint32_t block_id = 0;
+    int nblock = (type==TYPE_DIR) ? 1 : 0;
+    r = alloc_inodes_and_blocks(1,&inode_id,nblock,&block_id,nblock);
+    if(r<0){
+        return r;
+    }
+    if(type==TYPE_DIR){
+        dir_block_init(block_buf);
+        dir_block_insert(block_buf,".",inode_id,TYPE_DIR);
+        dir_block_insert(block_buf,"..",parent_id,TYPE_DIR);
+        if(write_dir_block(block_id)<0){
+            free_inodes_and_blocks(1,&inode_id,nblock,&block_id,nblock);
+            return -EIO;
+        }
+    }
 
+    inode_t *inode = read_inode(inode_id);
+    if(inode==NULL){
+        free_inodes_and_blocks(1,&inode_id,nblock,&block_id,nblock);
+        return -EIO;
+    }
+    memset(inode,0,sizeof(inode_t));
+    inode->file_type = type;
+    if(type==TYPE_DIR){
+        inode->link = 2;
+        inode->block_point[0] = block_id;
+        inode->size = BLOCK_SIZE;
+    } else {
+        inode->link = 1;
+        inode->size = 0;
+    }
+    r = write_inode(inode_id)<0 ? -EIO : dir_add_entry(parent_id,tmp,inode_id,type);
+    if(r<0){
+        free_inodes_and_blocks(1,&inode_id,nblock,&block_id,nblock);
+        return r;
+    }
+    if(type==TYPE_DIR && add_link(parent_id,1)<0){     // 新目录的 ".." 指向父目录
+        dir_remove_entry(parent_id,tmp);
+        free_inodes_and_blocks(1,&inode_id,nblock,&block_id,nblock);
+        return -EIO;
+    }
+    return inode_id;
 }
 
-int exec_touch(char *argv[],int argc){
-    if(argc<2){
-        printf("Too few arguments!\n");
-        return -1;
+/**
+ * @brief 读文件 inode_id 从 off 开始的至多 len 字节
+ * @return 成功返回读到的字节数（读到文件尾时可能少于len），失败返回负的错误码
+ */
+int file_read(uint32_t inode_id,char *buf,uint32_t len,uint32_t off){
+    char blk[BLOCK_SIZE];
+    inode_t inode;
+    if(load_inodes(&inode_id,1,&inode)<0){
+        return -EIO;
+    }
+    if(inode.file_type!=TYPE_FILE){
+        return -EISDIR;
+    }
+    if(off>=inode.size){
+        return 0;
+    }
+    if(len>inode.size-off){
+        len = inode.size-off;
+    }
+    uint32_t done = 0;
+    while(done<len){
+        uint32_t pos = off + done;
+        uint32_t in = pos % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - in;
+        if(n>len-done){
+            n = len-done;
+        }
+        if(load_block(inode.block_point[pos/BLOCK_SIZE],blk)<0){
+            return -EIO;
+        }
+        memcpy(buf+done,blk+in,n);
+        done += n;
     }
-    char tmp[MAXLINE];
-    char *path = argv[1];
-    uint32_t inode_id = find_path_directory(path,tmp);
-    // printf("find_path:path:%s,tmp:%s,inode_id:%d\n",path,tmp,inode_id);
-    inode_t* inode;
+    return done;
+}
 
-    if(inode_id <0 || tmp[0]=='\0'){
-        return -1;
+/**
+ * @brief 从 off 开始向文件 inode_id 写入 len 字节，必要时扩展文件
+ *        新增的块一次分配；off 超过文件尾时中间的部分补0
+ * @return 成功返回写入的字节数，超过最大文件长度返回-EFBIG，其余失败返回负的错误码
+ */
+int file_write(uint32_t inode_id,const char *buf,uint32_t len,uint32_t off){
+    char blk[BLOCK_SIZE];
+    inode_t inode;
+    if(load_inodes(&inode_id,1,&inode)<0){
+        return -EIO;
+    }
+    if(inode.file_type!=TYPE_FILE){
+        return -EISDIR;
+    }
+    if(len==0){
+        return 0;
     }
+    if(off>MAX_FILE_BLOCK_NUM*BLOCK_SIZE || len>MAX_FILE_BLOCK_NUM*BLOCK_SIZE-off){
+        return -EFBIG;
+    }
+    uint32_t end = off + len;
 
-    // int i = check_dup_name(tmp,inode_id,TYPE_DIR);
-    inode = read_inode(inode_id);
-    // for(int j=0;j<6;j++){
-    //     // 只有根目录的block_point[0] = 0，其余block_point都不能为0 
-    //     // 否则视为该block_point是无效的,还没有指定
-    //     if(inode_id==0){
-    //         for(int k=0;k<inode->size;k++){
-    //             read_dir_item(inode->block_point[k]);
-    //             get_free_block(1)
-    //         }
-    //     }
-    // }
-    // printf("cur_dir:inode_id:%d,\n")
-
-    int block_id = get_free_block(1);
-    // inode_id = get_free_inode();
-
-    int success = 0;
-    for(int k=1;k<6;k++){
-        // TODO：这里只实现了每个文件夹下最多五个dir_item
-        if(inode->block_point[k]==0){ //未分配
-            // 直接分配
-            inode->block_point[k] = block_id;
-            inode->size++;
-            success = 1;
-            write_inode(inode_id);
-            break;
+    int have = inode_nblock(&inode);
+    int need = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if(need>have){
+        // 紧接在文件最后一块之后分配，使文件保持连续
+        uint32_t goal = have>0 ? inode.block_point[have-1] + 1 : 0;
+        int r = alloc_near(0,NULL,need-have,&inode.block_point[have],0,goal);
+        if(r<0){
+            return r;
         }
-        // else{
-        //     // 寻找一块空闲的dir_item空间，将其放入
-        // }
     }
-    if(!success){
-        printf("directory full!\n");
-        return -1;
+    for(int k=have;k<(int)(off/BLOCK_SIZE);k++){    // 文件尾与 off 之间的空洞
+        memset(blk,0,BLOCK_SIZE);
+        if(store_block(inode.block_point[k],blk)<0){
+            goto fail;
+        }
     }
 
-    inode_id = get_free_inode();
-
+    uint32_t done = 0;
+    while(done<len){
+        uint32_t pos = off + done;
+        int k = pos / BLOCK_SIZE;
+        uint32_t in = pos % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - in;
+        if(n>len-done){
+            n = len-done;
+        }
+        if(n<BLOCK_SIZE){   // 写不满一块：旧块先读出，新块补0
+            if(k<have){
+                if(load_block(inode.block_point[k],blk)<0){
+                    goto fail;
+                }
+            } else {
+                memset(blk,0,BLOCK_SIZE);
+            }
+        }
+        memcpy(blk+in,buf+done,n);
+        if(store_block(inode.block_point[k],blk)<0){
+            goto fail;
+        }
+        done += n;
+    }
 
-    dir_item_t* dir_item = read_dir_item(block_id,0);
-    dir_item_buf.inode_id = inode_id;
-    strcpy(dir_item_buf.name,tmp);
-    // printf("mkdir(),name:%s \nblock_point:%d\ninode_id:%d\n",dir_item_buf.name,block_id,inode_id);
-    dir_item_buf.type = TYPE_FILE;
-    dir_item_buf.valid = 1;
-    write_dir_item(block_id,1);
-    // read_spblock();
-    // printf("mkdir:block_map[1]:%.8x\n",((sp_block_t*)sp_block_buf)->block_map[1]);
+    if(end>inode.size){
+        inode.size = end;
+    }
+    if(store_inodes(&inode_id,1,&inode)<0){
+        goto fail;
+    }
+    return len;
 
-    inode = read_inode(inode_id);
-    inode->block_point[0] = 0;
-    inode->file_type = TYPE_FILE;
-    inode->link = 0;
-    inode->size += 1;
-    write_inode(inode_id);
+fail:
+    // 新分配的块还没有记进 inode，归还它们，否则会一直占着位图和空闲区间索引
+    if(need>have){
+        free_inodes_and_blocks(0,NULL,need-have,&inode.block_point[have],0);
+    }
+    return -EIO;
 }
 
-int exec_cp(char *argv[],int argc){
-    if(argc!=3){
-        printf("arguments wrong!\n");
-        return -1;
+/**
+ * @brief 冻结当前的块占用位图，创建名为 name 的快照
+ * @return 成功返回0,失败返回负的错误码
+ */
+int take_snapshot(const char *name){
+    if(snapshot_view()){    // 快照视图中不能再创建快照
+        return -EROFS;
     }
-
-    char *src_path = argv[2];
-    char *dst_path = argv[1];
-    char tmp1[MAXLINE];
-    char tmp2[MAXLINE];
-    // 首先找到src_path
-    int inode_id = find_path_directory(src_path,tmp1);
-
-    inode_t *inode = read_inode(inode_id);
-    // 读取src目录的inode，此时tmp1存储src文件的名称。
-    // 接下来找到src文件，并且判断其类型。如果不是FILE，则返回错误
-    // 如果是FILE，则inode指向src_file的inode，然后缓存其inode的信息。
-    // 并且调用touch创建文件
-    for(int i=1;i<6;i++){
-        if(inode->block_point[i]==0){
+    if(sync_spblock()<0 || disk_flush()<0){     // 快照直接共享 image 中的块，缓冲的写必须先落盘
+        return -EIO;
+    }
+    // 块占用位图中的一个数据块对应 NDISKBLOCK_PER_DATABLOCK 个 disk block
+    if(meta_need_all(&bmap)<0){
+        return -EIO;
+    }
+    unsigned int ndisk_block = disk_nblocks();
+    unsigned char *shared = (unsigned char*)calloc(((size_t)ndisk_block + 7) / 8,1);
+    if(shared==NULL){
+        return -ENOMEM;
+    }
+    for(uint32_t b=0;b<fs_layout.nblocks;b++){
+        if(!map_test(&bmap,b)){
             continue;
         }
-        read_dir_item(inode->block_point[i],0);
-        for(int k=0;k<8;k++){
-            // block_buf[p].type==TYPE_DIR \
-            //                 && !strcmp(tmp,block_buf[p].name) \
-            //                 && block_buf[p].valid)
-            if(block_buf[k].type==TYPE_FILE \
-                && !strcmp(tmp1,block_buf[k].name) \
-                && block_buf[k].valid){
-                    char* new_argv[MAXARGS];
-                    strcpy(new_argv[0],"touch");
-                    strcpy(new_argv[1],dst_path);
-                    if(exec_touch(new_argv,2)<0){
-                        return -1;
-                    }
-                    return 0;
-                }
+        for(int i=0;i<NDISKBLOCK_PER_DATABLOCK;i++){
+            uint32_t d = block_disk_block(b) + i;
+            shared[d/8] |= (0x80 >> (d%8));
         }
     }
-
-
+    int r = snapshot_create(name,shared);
+    free(shared);
+    return r<0 ? -EINVAL : 0;
 }
 
+/**
+ * @brief 关闭文件系统
+ * @return 成功返回0,失败返回-EIO
+ */
 int shutdown_filesys(){
-    printf("Shutting down file system...\n");
-    if(close_disk()<0){
-        printf("shutdown error!\n");
-        return -1;
+    int r = sync_spblock();
+    icache_clear();
+    extent_reset(&block_index);
+    extent_reset(&inode_index);
+    meta_free_all();
+    sp_dirty = 0;
+    csum = 0;
+    if(close_disk()<0 || r<0){
+        return -EIO;
     }
-    printf("Goodbye!\n");
-    sleep(1);
-    exit(0);
-}
\ No newline at end of file
+    return 0;
+}
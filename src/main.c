@@ -1,8 +1,64 @@
-#include "disk.h"
 #include "sh.h"
+#include "naivefs.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * @brief 解析 -S 的参数，可带 K/M/G/T 后缀（以1024为单位）
+ * @return 成功返回字节数，格式不对返回0
+ */
+static uint64_t parse_size(const char *s){
+    char *end;
+    uint64_t n = strtoull(s,&end,10);
+    int shift = 0;
+    switch(*end){
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if(end==s || *end!='\0' || n>(UINT64_MAX>>shift)){
+        return 0;
+    }
+    return n << shift;
+}
 
 int
 main(int argc, char**argv){
-    run_shell();
-}
\ No newline at end of file
+    const char *snapshot = NULL;
+    int flags = 0;
+    uint64_t size = 0;
+    uint64_t inodes = 0;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-d") || !strcmp(argv[i],"--discard")){
+            flags |= NFS_MOUNT_DISCARD;     // 释放的块在 disk 文件中打洞
+        } else if(!strcmp(argv[i],"-D") || !strcmp(argv[i],"--direct")){
+            flags |= NFS_MOUNT_DIRECT;      // 不经过宿主的页缓存
+        } else if(!strcmp(argv[i],"-c") || !strcmp(argv[i],"--csum")){
+            flags |= NFS_MOUNT_CSUM;        // 格式化时开启元数据校验
+        } else if(!strcmp(argv[i],"-S") && i+1<argc){
+            size = parse_size(argv[++i]);   // 新建 disk 的大小
+            if(size==0){
+                printf("bad size \"%s\"\n",argv[i]);
+                return 1;
+            }
+        } else if(!strcmp(argv[i],"-N") && i+1<argc){
+            inodes = strtoull(argv[++i],NULL,10);   // 格式化时的inode数
+        } else if(!strcmp(argv[i],"-s") && i+1<argc){
+            snapshot = argv[++i];           // 挂载快照而不是当前的 disk
+        } else if(!strcmp(argv[i],"-t") && i+1<argc){
+            int r = nfs_trace_start(argv[++i]);    // 记录所有操作，可用 replay 重放
+            if(r<0){
+                printf("can not record trace to %s: %s\n",argv[i],nfs_strerror(r));
+                return 1;
+            }
+        } else {
+            printf("usage: %s [-d|--discard] [-D|--direct] [-c|--csum] [-S size] [-N inodes] [-s snapshot] [-t trace]\n",argv[0]);
+            return 1;
+        }
+    }
+    nfs_set_format(size,inodes);
+    run_shell(snapshot,flags);
+}
@@ -0,0 +1,558 @@
+#include "naivefs.h"
+#include "util.h"
+#include "filesys.h"
+#include "tree.h"
+#include "walk.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * 修改文件系统的函数使用 filesys.c 中的全局缓冲和 super block，
+ * 只读的接口（查找、stat、读文件、读目录、遍历）只使用局部缓冲、块缓存和inode缓存。
+ * 因此 nfs_lock 是读写锁：只读接口可以并发执行，修改文件系统的接口独占执行。
+ * 需要回调的接口先在锁内把结果收集起来，解锁后再调用回调。
+ */
+static pthread_rwlock_t nfs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int mounted = 0;
+
+#define SHARED 0
+#define EXCLUSIVE 1
+
+/**
+ * @brief 加锁并检查是否已挂载，mode 为 SHARED 或 EXCLUSIVE
+ * @return 已挂载返回0（持有锁），否则返回-ENODEV（不持有锁）
+ */
+static int enter(int mode){
+    if(mode==EXCLUSIVE){
+        pthread_rwlock_wrlock(&nfs_lock);
+    } else {
+        pthread_rwlock_rdlock(&nfs_lock);
+    }
+    if(!mounted){
+        pthread_rwlock_unlock(&nfs_lock);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+/**
+ * @brief 解锁，mode 须与 enter 时相同。独占操作先把延迟的 super block 和元数据数组修改写进disk；
+ *        共享操作不写，sync_spblock 修改全局状态，在读锁下并发执行会互相冲突
+ */
+static int leave(int mode,int r){
+    if(mode==EXCLUSIVE && mounted && sync_spblock()<0 && r>=0){
+        r = -EIO;
+    }
+    pthread_rwlock_unlock(&nfs_lock);
+    return r;
+}
+
+static void fill_stat(nfs_stat_t *st,uint32_t ino,inode_t *inode){
+    st->ino = ino;
+    st->type = inode->file_type;
+    st->link = inode->link;
+    st->size = inode->size;
+    st->blocks = inode_nblock(inode);
+    st->block_size = BLOCK_SIZE;
+}
+
+void nfs_set_format(uint64_t size,uint64_t inodes){
+    pthread_rwlock_wrlock(&nfs_lock);
+    set_format(size,inodes);
+    pthread_rwlock_unlock(&nfs_lock);
+}
+
+int nfs_mount(const char *image,const char *snapshot,int flags){
+    int r;
+    pthread_rwlock_wrlock(&nfs_lock);
+    if(mounted){
+        return leave(EXCLUSIVE,-EBUSY);
+    }
+    if(snapshot_use(snapshot)<0){
+        return leave(EXCLUSIVE,-EINVAL);
+    }
+    set_discard(flags & NFS_MOUNT_DISCARD);
+    disk_use_direct(flags & NFS_MOUNT_DIRECT);
+    set_format_csum(flags & NFS_MOUNT_CSUM);
+    r = init_filesystem(image ? image : DISK_FILE);
+    set_format_csum(0);
+    if(r<0){
+        snapshot_use(NULL);
+        set_discard(0);
+        disk_use_direct(0);
+        return leave(EXCLUSIVE,r);
+    }
+    mounted = 1;
+    return leave(EXCLUSIVE,0);
+}
+
+int nfs_unmount(void){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    r = shutdown_filesys();
+    mounted = 0;
+    snapshot_use(NULL);
+    set_discard(0);
+    disk_use_direct(0);
+    return leave(EXCLUSIVE,r);
+}
+
+static int do_lookup(const char *path,nfs_ino_t *ino){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = find_path(path,NULL);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    *ino = r;
+    return leave(SHARED,0);
+}
+
+static int do_stat(const char *path,nfs_stat_t *st){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = find_path(path,NULL);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    uint32_t ino = r;
+    inode_t inode;
+    if(load_inodes(&ino,1,&inode)<0){
+        return leave(SHARED,-EIO);
+    }
+    fill_stat(st,ino,&inode);
+    return leave(SHARED,0);
+}
+
+static int do_mkdir(const char *path){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    r = create_entry(path,TYPE_DIR);
+    return leave(EXCLUSIVE,r<0 ? r : 0);
+}
+
+static int do_create(const char *path,nfs_ino_t *ino){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    r = create_entry(path,TYPE_FILE);
+    if(r<0){
+        return leave(EXCLUSIVE,r);
+    }
+    if(ino){
+        *ino = r;
+    }
+    return leave(EXCLUSIVE,0);
+}
+
+/**
+ * @brief 检查 ino 是否指向已分配的inode，调用者持有锁
+ */
+static int check_ino(nfs_ino_t ino){
+    int r = inode_in_use(ino);
+    if(r<0){
+        return r;
+    }
+    return r ? 0 : -ENOENT;
+}
+
+static ssize_t do_read(nfs_ino_t ino,void *buf,size_t len,uint64_t off){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = check_ino(ino);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    if(off>=(uint64_t)MAX_FILE_BLOCK_NUM*BLOCK_SIZE){
+        return leave(SHARED,0);
+    }
+    if(len>(size_t)MAX_FILE_BLOCK_NUM*BLOCK_SIZE){
+        len = MAX_FILE_BLOCK_NUM*BLOCK_SIZE;
+    }
+    return leave(SHARED,file_read(ino,(char*)buf,len,off));
+}
+
+static ssize_t do_write(nfs_ino_t ino,const void *buf,size_t len,uint64_t off){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    r = check_ino(ino);
+    if(r<0){
+        return leave(EXCLUSIVE,r);
+    }
+    if(off+len<off || off+len>(uint64_t)MAX_FILE_BLOCK_NUM*BLOCK_SIZE){
+        return leave(EXCLUSIVE,-EFBIG);
+    }
+    return leave(EXCLUSIVE,file_write(ino,(const char*)buf,len,off));
+}
+
+typedef struct dirent_list {
+    nfs_dirent_t *ents;
+    int count;
+    int cap;
+} dirent_list_t;
+
+static int collect_dirent(dir_item_t *item,void *arg){
+    dirent_list_t *l = (dirent_list_t*)arg;
+    if(l->count==l->cap){
+        int cap = l->cap ? l->cap*2 : 16;
+        nfs_dirent_t *ents = (nfs_dirent_t*)realloc(l->ents,sizeof(nfs_dirent_t) * cap);
+        if(ents==NULL){
+            return -ENOMEM;
+        }
+        l->ents = ents;
+        l->cap = cap;
+    }
+    nfs_dirent_t *ent = &l->ents[l->count++];
+    ent->ino = item->inode_id;
+    ent->type = item->type;
+    memcpy(ent->name,item->name,item->name_len);
+    ent->name[item->name_len] = '\0';
+    return 0;
+}
+
+static int do_readdir(const char *path,nfs_readdir_fn fn,void *arg){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = find_path(path,NULL);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    dirent_list_t l = {NULL,0,0};
+    r = leave(SHARED,dir_iterate(r,collect_dirent,&l));
+    for(int i=0;i<l.count && r==0;i++){
+        r = fn(&l.ents[i],arg);
+    }
+    free(l.ents);
+    return r;
+}
+
+static int do_readdir_stat(const char *path,nfs_readdir_stat_fn fn,void *arg){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = find_path(path,NULL);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    dirent_list_t l = {NULL,0,0};
+    uint32_t *ids = NULL;
+    inode_t *inodes = NULL;
+    nfs_stat_t st;
+    r = dir_iterate(r,collect_dirent,&l);
+    if(r==0 && l.count>0){
+        ids = (uint32_t*)malloc(sizeof(uint32_t) * l.count);
+        inodes = (inode_t*)malloc(sizeof(inode_t) * l.count);
+        if(ids==NULL || inodes==NULL){
+            r = -ENOMEM;
+        } else {
+            for(int i=0;i<l.count;i++){
+                ids[i] = l.ents[i].ino;
+            }
+            r = load_inodes(ids,l.count,inodes)<0 ? -EIO : 0;
+        }
+    }
+    leave(SHARED,0);
+    for(int i=0;i<l.count && r==0;i++){
+        fill_stat(&st,ids[i],&inodes[i]);
+        r = fn(&l.ents[i],&st,arg);
+    }
+    free(l.ents);
+    free(ids);
+    free(inodes);
+    return r;
+}
+
+static int do_remove(const char *path,int mode){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    return leave(EXCLUSIVE,remove_path(path,mode));
+}
+
+static int do_copy(const char *src,const char *dst){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    return leave(EXCLUSIVE,copy_tree(src,dst));
+}
+
+static int do_walk(const char *path,nfs_walk_fn fn,void *arg){
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    r = find_path(path,NULL);
+    if(r<0){
+        return leave(SHARED,r);
+    }
+    walk_t w;
+    if(walk_tree(&w,r,path)<0){
+        walk_free(&w);
+        return leave(SHARED,-EIO);
+    }
+    leave(SHARED,0);
+
+    // 遍历结果不再引用文件系统，之后不需要持有锁
+    uint64_t *total = (uint64_t*)calloc(w.count,sizeof(uint64_t));
+    int *order = walk_sorted(&w);
+    r = 0;
+    if(total==NULL || order==NULL){
+        r = -ENOMEM;
+        goto out;
+    }
+    // 子节点下标总大于父节点，逆序扫描即可自底向上累加
+    for(int i=w.count-1;i>=0;i--){
+        total[i] += inode_nblock(&w.nodes[i].inode);
+        if(w.nodes[i].parent>=0){
+            total[w.nodes[i].parent] += total[i];
+        }
+    }
+    for(int i=0;i<w.count && r==0;i++){
+        walk_node_t *node = &w.nodes[order[i]];
+        nfs_stat_t st;
+        fill_stat(&st,node->inode_id,&node->inode);
+        r = fn(node->path,&st,total[order[i]],arg);
+    }
+
+out:
+    free(total);
+    free(order);
+    walk_free(&w);
+    return r;
+}
+
+static int do_snapshot_create(const char *name){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    return leave(EXCLUSIVE,take_snapshot(name));
+}
+
+static int do_snapshot_delete(const char *name){
+    int r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    return leave(EXCLUSIVE,snapshot_delete(name)<0 ? -EINVAL : 0);
+}
+
+static int do_sync(void){
+    int r = enter(SHARED);      // 写回有自己的锁，不阻塞读
+    if(r<0){
+        return r;
+    }
+    if(!spblock_pending()){
+        return leave(SHARED,disk_flush()<0 ? -EIO : 0);
+    }
+    // 之前的操作没能写出 super block，重试会修改全局状态，换成独占锁
+    leave(SHARED,0);
+    r = enter(EXCLUSIVE);
+    if(r<0){
+        return r;
+    }
+    r = (sync_spblock()<0 || disk_flush()<0) ? -EIO : 0;
+    return leave(EXCLUSIVE,r);
+}
+
+static int do_snapshot_list(nfs_snapshot_fn fn,void *arg){
+    char names[MAX_SNAPSHOTS][SNAPSHOT_NAME_MAX+1];
+    uint64_t sizes[MAX_SNAPSHOTS];
+    int mounted_at = -1;
+    int r = enter(SHARED);
+    if(r<0){
+        return r;
+    }
+    int n = snapshot_list(names,MAX_SNAPSHOTS);
+    if(n>MAX_SNAPSHOTS){
+        n = MAX_SNAPSHOTS;
+    }
+    for(int i=0;i<n;i++){
+        sizes[i] = (uint64_t)snapshot_size(names[i]) * DEVICE_BLOCK_SIZE;
+        if(snapshot_view() && !strcmp(snapshot_view(),names[i])){
+            mounted_at = i;
+        }
+    }
+    leave(SHARED,0);
+    for(int i=0;i<n && r==0;i++){
+        r = fn(names[i],sizes[i],i==mounted_at,arg);
+    }
+    return r;
+}
+
+/*
+ * 以下为对外接口：执行上面的实现，并在记录 trace 时追加一条记录
+ */
+
+int nfs_lookup(const char *path,nfs_ino_t *ino){
+    uint64_t t = trace_begin();
+    int r = do_lookup(path,ino);
+    trace_end(t,TRACE_OP_LOOKUP,path,NULL,0,0,0,r<0 ? r : (int32_t)*ino);
+    return r;
+}
+
+int nfs_stat(const char *path,nfs_stat_t *st){
+    uint64_t t = trace_begin();
+    int r = do_stat(path,st);
+    trace_end(t,TRACE_OP_STAT,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_mkdir(const char *path){
+    uint64_t t = trace_begin();
+    int r = do_mkdir(path);
+    trace_end(t,TRACE_OP_MKDIR,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_create(const char *path,nfs_ino_t *ino){
+    nfs_ino_t tmp;
+    uint64_t t = trace_begin();
+    int r = do_create(path,&tmp);
+    if(r==0 && ino){
+        *ino = tmp;
+    }
+    trace_end(t,TRACE_OP_CREATE,path,NULL,0,0,0,r<0 ? r : (int32_t)tmp);
+    return r;
+}
+
+ssize_t nfs_read(nfs_ino_t ino,void *buf,size_t len,uint64_t off){
+    uint64_t t = trace_begin();
+    ssize_t r = do_read(ino,buf,len,off);
+    trace_end(t,TRACE_OP_READ,NULL,NULL,ino,off,len,r);
+    return r;
+}
+
+ssize_t nfs_write(nfs_ino_t ino,const void *buf,size_t len,uint64_t off){
+    uint64_t t = trace_begin();
+    ssize_t r = do_write(ino,buf,len,off);
+    trace_end(t,TRACE_OP_WRITE,NULL,NULL,ino,off,len,r);
+    return r;
+}
+
+int nfs_readdir(const char *path,nfs_readdir_fn fn,void *arg){
+    uint64_t t = trace_begin();
+    int r = do_readdir(path,fn,arg);
+    trace_end(t,TRACE_OP_READDIR,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_readdir_stat(const char *path,nfs_readdir_stat_fn fn,void *arg){
+    uint64_t t = trace_begin();
+    int r = do_readdir_stat(path,fn,arg);
+    trace_end(t,TRACE_OP_READDIR_STAT,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_unlink(const char *path){
+    uint64_t t = trace_begin();
+    int r = do_remove(path,REMOVE_FILE);
+    trace_end(t,TRACE_OP_UNLINK,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_rmdir(const char *path){
+    uint64_t t = trace_begin();
+    int r = do_remove(path,REMOVE_EMPTY_DIR);
+    trace_end(t,TRACE_OP_RMDIR,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_remove_tree(const char *path){
+    uint64_t t = trace_begin();
+    int r = do_remove(path,REMOVE_TREE);
+    trace_end(t,TRACE_OP_REMOVE_TREE,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_copy(const char *src,const char *dst){
+    uint64_t t = trace_begin();
+    int r = do_copy(src,dst);
+    trace_end(t,TRACE_OP_COPY,src,dst,0,0,0,r);
+    return r;
+}
+
+int nfs_walk(const char *path,nfs_walk_fn fn,void *arg){
+    uint64_t t = trace_begin();
+    int r = do_walk(path,fn,arg);
+    trace_end(t,TRACE_OP_WALK,path,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_snapshot_create(const char *name){
+    uint64_t t = trace_begin();
+    int r = do_snapshot_create(name);
+    trace_end(t,TRACE_OP_SNAPSHOT_CREATE,name,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_snapshot_delete(const char *name){
+    uint64_t t = trace_begin();
+    int r = do_snapshot_delete(name);
+    trace_end(t,TRACE_OP_SNAPSHOT_DELETE,name,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_snapshot_list(nfs_snapshot_fn fn,void *arg){
+    uint64_t t = trace_begin();
+    int r = do_snapshot_list(fn,arg);
+    trace_end(t,TRACE_OP_SNAPSHOT_LIST,NULL,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_sync(void){
+    uint64_t t = trace_begin();
+    int r = do_sync();
+    trace_end(t,TRACE_OP_SYNC,NULL,NULL,0,0,0,r);
+    return r;
+}
+
+int nfs_trace_start(const char *path){
+    return trace_start(path);
+}
+
+int nfs_trace_stop(void){
+    return trace_stop();
+}
+
+void nfs_trace_note(const char *text){
+    trace_end(trace_begin(),TRACE_OP_NOTE,text,NULL,0,0,0,0);
+}
+
+void nfs_iostat(nfs_iostat_t *st){
+    disk_stats_t d;
+    disk_get_stats(&d);
+    st->block_reads = d.reads;
+    st->block_cache_hits = d.cache_hits;
+    st->block_writes = d.writes;
+    st->block_discards = d.discards;
+    st->block_flushes = d.flushed;
+    st->write_ios = d.write_ios;
+}
+
+const char* nfs_strerror(int err){
+    return strerror(-err);
+}
@@ -0,0 +1,431 @@
+#include "naivefs.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <glob.h>
+
+/*
+ * replay：在 image 上重新执行 nfs_trace_start 记录下的操作，
+ * 按记录时的节奏或尽可能快地执行，报告吞吐量、延迟分布和块I/O次数。
+ *
+ * 重放得到的inode号可能与记录时不同：lookup/create 的结果建立
+ * “记录的inode号 -> 重放的inode号” 的映射，read/write 按映射换算。
+ */
+
+#define NBUCKET 32      // 延迟直方图，第 i 个桶为 [2^(i-1), 2^i) 微秒
+#define DATA_MAX (64*1024)  // 单次读写的最大长度
+
+static const char *op_names[TRACE_OP_MAX] = {
+    [TRACE_OP_NOTE] = "note",
+    [TRACE_OP_LOOKUP] = "lookup",
+    [TRACE_OP_STAT] = "stat",
+    [TRACE_OP_MKDIR] = "mkdir",
+    [TRACE_OP_CREATE] = "create",
+    [TRACE_OP_READ] = "read",
+    [TRACE_OP_WRITE] = "write",
+    [TRACE_OP_READDIR] = "readdir",
+    [TRACE_OP_UNLINK] = "unlink",
+    [TRACE_OP_RMDIR] = "rmdir",
+    [TRACE_OP_REMOVE_TREE] = "remove_tree",
+    [TRACE_OP_COPY] = "copy",
+    [TRACE_OP_WALK] = "walk",
+    [TRACE_OP_SNAPSHOT_CREATE] = "snapshot_create",
+    [TRACE_OP_SNAPSHOT_DELETE] = "snapshot_delete",
+    [TRACE_OP_SNAPSHOT_LIST] = "snapshot_list",
+    [TRACE_OP_SYNC] = "sync",
+    [TRACE_OP_READDIR_STAT] = "readdir_stat",
+};
+
+typedef struct ino_map {        // 开放寻址的 uint32 -> uint32 表
+    uint32_t *keys;
+    uint32_t *vals;
+    uint8_t *used;
+    size_t cap;
+    size_t count;
+} ino_map_t;
+
+static size_t slot_of(ino_map_t *m,uint32_t key){
+    size_t i = (key * 2654435761u) & (m->cap - 1);
+    while(m->used[i] && m->keys[i]!=key){
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+static int map_put(ino_map_t *m,uint32_t key,uint32_t val){
+    if((m->count + 1) * 2 > m->cap){
+        ino_map_t n;
+        n.cap = m->cap ? m->cap * 2 : 256;
+        n.count = 0;
+        n.keys = (uint32_t*)malloc(sizeof(uint32_t) * n.cap);
+        n.vals = (uint32_t*)malloc(sizeof(uint32_t) * n.cap);
+        n.used = (uint8_t*)calloc(n.cap,1);
+        if(!n.keys || !n.vals || !n.used){
+            free(n.keys);
+            free(n.vals);
+            free(n.used);
+            return -1;
+        }
+        for(size_t i=0;i<m->cap;i++){
+            if(m->used[i]){
+                size_t j = slot_of(&n,m->keys[i]);
+                n.used[j] = 1;
+                n.keys[j] = m->keys[i];
+                n.vals[j] = m->vals[i];
+                n.count++;
+            }
+        }
+        free(m->keys);
+        free(m->vals);
+        free(m->used);
+        *m = n;
+    }
+    size_t i = slot_of(m,key);
+    if(!m->used[i]){
+        m->used[i] = 1;
+        m->keys[i] = key;
+        m->count++;
+    }
+    m->vals[i] = val;
+    return 0;
+}
+
+static uint32_t map_get(ino_map_t *m,uint32_t key){
+    if(m->cap==0){
+        return key;
+    }
+    size_t i = slot_of(m,key);
+    return m->used[i] ? m->vals[i] : key;
+}
+
+static int skip_dirent(const nfs_dirent_t *ent,void *arg){
+    return 0;
+}
+
+static int skip_dirent_stat(const nfs_dirent_t *ent,const nfs_stat_t *st,void *arg){
+    return 0;
+}
+
+static int skip_node(const char *path,const nfs_stat_t *st,uint64_t total,void *arg){
+    return 0;
+}
+
+static int skip_snapshot(const char *name,uint64_t size,int mounted,void *arg){
+    return 0;
+}
+
+static int cmp_u64(const void *a,const void *b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x<y ? -1 : (x>y);
+}
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t){
+    uint64_t now = now_ns();
+    if(t>now){
+        struct timespec ts;
+        ts.tv_sec = (t - now) / 1000000000;
+        ts.tv_nsec = (t - now) % 1000000000;
+        nanosleep(&ts,NULL);
+    }
+}
+
+/**
+ * @brief 读入整个记录文件
+ * @return 成功返回缓冲区（由调用者 free），失败返回NULL
+ */
+static char* load_trace(const char *path,size_t *size){
+    FILE *f = fopen(path,"rb");
+    if(f==NULL){
+        return NULL;
+    }
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    char *buf = (char*)malloc(cap);
+    while(buf){
+        len += fread(buf+len,1,cap-len,f);
+        if(len<cap){
+            break;
+        }
+        char *p = (char*)realloc(buf,cap*2);
+        if(p==NULL){
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = p;
+        cap *= 2;
+    }
+    fclose(f);
+    trace_header_t *hdr = (trace_header_t*)buf;
+    if(buf && (len<sizeof(*hdr) || hdr->magic!=TRACE_MAGIC || hdr->version!=TRACE_VERSION)){
+        free(buf);
+        return NULL;
+    }
+    *size = len;
+    return buf;
+}
+
+static void usage(const char *prog){
+    printf("usage: %s [-i image] [--fresh] [-f|--fast] trace\n",prog);
+    printf("  -i image  replay against image (default \"disk\")\n");
+    printf("  --fresh   delete image and its snapshots first, replaying on a new image\n");
+    printf("  -f        run as fast as possible instead of at the recorded pace\n");
+}
+
+int
+main(int argc, char**argv){
+    const char *image = "disk";
+    const char *trace_path = NULL;
+    int fresh = 0;
+    int fast = 0;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-i") && i+1<argc){
+            image = argv[++i];
+        } else if(!strcmp(argv[i],"--fresh")){
+            fresh = 1;
+        } else if(!strcmp(argv[i],"-f") || !strcmp(argv[i],"--fast")){
+            fast = 1;
+        } else if(argv[i][0]!='-' && trace_path==NULL){
+            trace_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(trace_path==NULL){
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t size;
+    char *trace = load_trace(trace_path,&size);
+    if(trace==NULL){
+        printf("can not read trace \"%s\"\n",trace_path);
+        return 1;
+    }
+    // 先数出操作数，为每个操作的延迟分配空间
+    size_t nrec = 0;
+    size_t off = sizeof(trace_header_t);
+    while(off + sizeof(trace_rec_t)<=size){
+        trace_rec_t *rec = (trace_rec_t*)(trace + off);
+        off += sizeof(trace_rec_t) + rec->path_len + rec->path2_len;
+        if(off>size){
+            break;
+        }
+        nrec++;
+    }
+    uint64_t *lat = (uint64_t*)malloc(sizeof(uint64_t) * (nrec ? nrec : 1));
+    uint64_t *sorted = (uint64_t*)malloc(sizeof(uint64_t) * (nrec ? nrec : 1));
+    uint8_t *ops = (uint8_t*)malloc(nrec ? nrec : 1);
+    char *data = (char*)malloc(DATA_MAX);
+    if(lat==NULL || sorted==NULL || ops==NULL || data==NULL){
+        printf("out of memory\n");
+        return 1;
+    }
+    memset(data,'r',DATA_MAX);
+
+    if(fresh){     // 旧 image 的快照也一并删除
+        size_t len = strlen(image) + sizeof(".snap.*");
+        char *pattern = (char*)malloc(len);
+        glob_t g;
+        if(pattern){
+            snprintf(pattern,len,"%s.snap.*",image);
+            if(glob(pattern,0,NULL,&g)==0){
+                for(size_t i=0;i<g.gl_pathc;i++){
+                    unlink(g.gl_pathv[i]);
+                }
+                globfree(&g);
+            }
+            free(pattern);
+        }
+        unlink(image);
+    }
+    int r = nfs_mount(image,NULL,0);
+    if(r<0){
+        printf("mount error: %s\n",nfs_strerror(r));
+        return 1;
+    }
+
+    ino_map_t map;
+    memset(&map,0,sizeof(map));
+    nfs_iostat_t io0, io1;
+    nfs_iostat(&io0);
+    size_t nop = 0;
+    size_t mismatch = 0;
+    uint64_t start = now_ns();
+    uint64_t first_ts = 0;
+    off = sizeof(trace_header_t);
+    for(size_t k=0;k<nrec;k++){
+        trace_rec_t *rec = (trace_rec_t*)(trace + off);
+        char path[UINT16_MAX + 1];
+        char path2[UINT16_MAX + 1];
+        memcpy(path,trace + off + sizeof(trace_rec_t),rec->path_len);
+        path[rec->path_len] = '\0';
+        memcpy(path2,trace + off + sizeof(trace_rec_t) + rec->path_len,rec->path2_len);
+        path2[rec->path2_len] = '\0';
+        off += sizeof(trace_rec_t) + rec->path_len + rec->path2_len;
+        if(rec->op==TRACE_OP_NOTE || rec->op>=TRACE_OP_MAX){
+            continue;
+        }
+        if(nop==0){
+            first_ts = rec->ts;
+        }
+        if(!fast){
+            sleep_until(start + (rec->ts - first_ts));
+        }
+
+        nfs_ino_t ino;
+        nfs_stat_t st;
+        uint32_t count = rec->count<DATA_MAX ? rec->count : DATA_MAX;
+        uint64_t t0 = now_ns();
+        switch(rec->op){
+        case TRACE_OP_LOOKUP:
+            r = nfs_lookup(path,&ino);
+            break;
+        case TRACE_OP_STAT:
+            r = nfs_stat(path,&st);
+            break;
+        case TRACE_OP_MKDIR:
+            r = nfs_mkdir(path);
+            break;
+        case TRACE_OP_CREATE:
+            r = nfs_create(path,&ino);
+            break;
+        case TRACE_OP_READ:
+            r = nfs_read(map_get(&map,rec->ino),data,count,rec->off);
+            break;
+        case TRACE_OP_WRITE:
+            r = nfs_write(map_get(&map,rec->ino),data,count,rec->off);
+            break;
+        case TRACE_OP_READDIR:
+            r = nfs_readdir(path,skip_dirent,NULL);
+            break;
+        case TRACE_OP_UNLINK:
+            r = nfs_unlink(path);
+            break;
+        case TRACE_OP_RMDIR:
+            r = nfs_rmdir(path);
+            break;
+        case TRACE_OP_REMOVE_TREE:
+            r = nfs_remove_tree(path);
+            break;
+        case TRACE_OP_COPY:
+            r = nfs_copy(path,path2);
+            break;
+        case TRACE_OP_WALK:
+            r = nfs_walk(path,skip_node,NULL);
+            break;
+        case TRACE_OP_SNAPSHOT_CREATE:
+            r = nfs_snapshot_create(path);
+            break;
+        case TRACE_OP_SNAPSHOT_DELETE:
+            r = nfs_snapshot_delete(path);
+            break;
+        case TRACE_OP_SNAPSHOT_LIST:
+            r = nfs_snapshot_list(skip_snapshot,NULL);
+            break;
+        case TRACE_OP_SYNC:
+            r = nfs_sync();
+            break;
+        case TRACE_OP_READDIR_STAT:
+            r = nfs_readdir_stat(path,skip_dirent_stat,NULL);
+            break;
+        }
+        uint64_t t = now_ns() - t0;
+
+        if(rec->op==TRACE_OP_LOOKUP || rec->op==TRACE_OP_CREATE){
+            if(r==0 && rec->result>=0){
+                map_put(&map,rec->result,ino);
+            }
+            if((r<0) != (rec->result<0) || (r<0 && r!=rec->result)){
+                mismatch++;
+            }
+        } else if(r!=rec->result){
+            mismatch++;
+        }
+        ops[nop] = rec->op;
+        lat[nop++] = t;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    nfs_sync();     // 缓冲的写也计入
+    nfs_iostat(&io1);
+    r = nfs_unmount();
+    if(r<0){
+        printf("unmount error: %s\n",nfs_strerror(r));
+    }
+
+    printf("replayed %zu operations in %.3f s (%.0f ops/s, %s), %zu results differ from the trace\n",
+        nop,elapsed,elapsed>0 ? nop/elapsed : 0.0,fast ? "as fast as possible" : "recorded pace",mismatch);
+    printf("\n%-16s %8s %10s %10s %10s %10s\n","op","count","mean(us)","p50(us)","p99(us)","max(us)");
+    for(int op=0;op<TRACE_OP_MAX;op++){
+        size_t n = 0;
+        uint64_t sum = 0;
+        for(size_t i=0;i<nop;i++){
+            if(ops[i]==op){
+                sorted[n++] = lat[i];
+                sum += lat[i];
+            }
+        }
+        if(n==0){
+            continue;
+        }
+        qsort(sorted,n,sizeof(uint64_t),cmp_u64);
+        printf("%-16s %8zu %10.1f %10.1f %10.1f %10.1f\n",op_names[op],n,sum/1e3/n,
+            sorted[n/2]/1e3,sorted[n*99/100]/1e3,sorted[n-1]/1e3);
+    }
+
+    size_t hist[NBUCKET] = {0};
+    size_t peak = 1;
+    for(size_t i=0;i<nop;i++){
+        int b = 0;
+        for(uint64_t us=lat[i]/1000;us>0 && b<NBUCKET-1;us>>=1){
+            b++;
+        }
+        hist[b]++;
+        if(hist[b]>peak){
+            peak = hist[b];
+        }
+    }
+    printf("\nlatency distribution:\n");
+    for(int b=0;b<NBUCKET;b++){
+        if(hist[b]==0){
+            continue;
+        }
+        char bar[51];
+        int w = hist[b] * 50 / peak;
+        memset(bar,'#',w);
+        bar[w] = '\0';
+        printf("  < %8lu us %8zu %s\n",1ul << b,hist[b],bar);
+    }
+
+    uint64_t reads = io1.block_reads - io0.block_reads;
+    uint64_t hits = io1.block_cache_hits - io0.block_cache_hits;
+    printf("\nblock I/O: %lu reads (%lu from the block cache), %lu writes, %lu discards\n",
+        (unsigned long)reads,(unsigned long)hits,
+        (unsigned long)(io1.block_writes - io0.block_writes),
+        (unsigned long)(io1.block_discards - io0.block_discards));
+    printf("writeback: %lu blocks reached the image in %lu write requests\n",
+        (unsigned long)(io1.block_flushes - io0.block_flushes),
+        (unsigned long)(io1.write_ios - io0.write_ios));
+
+    free(map.keys);
+    free(map.vals);
+    free(map.used);
+    free(lat);
+    free(sorted);
+    free(ops);
+    free(data);
+    free(trace);
+    return 0;
+}
@@ -0,0 +1,525 @@
+#include "naivefs.h"
+#include "proto.h"
+#include "tpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+/*
+ * naivefsd：挂载一次 image，通过 Unix domain socket 为多个本机客户端服务。
+ * 协议见 proto.h。
+ *
+ * 主线程运行 epoll 事件循环，负责 accept、读入请求帧和发送积压的响应；
+ * 每个完整的请求帧作为一个任务交给线程池执行，同一连接上的多个请求可以并发执行。
+ * 工作线程把响应追加到连接的发送缓冲并直接尝试发送，发不完时才让事件循环关注 EPOLLOUT。
+ * 所有请求共用 naivefs 的块缓存和inode缓存，只读请求之间不互斥。
+ */
+
+typedef struct conn {
+    int fd;
+    char *in;                   // 尚未凑成完整帧的输入，只由事件循环访问
+    size_t in_len;
+    size_t in_cap;
+    char *out;                  // 尚未发出的响应，以下字段由 lock 保护
+    size_t out_len;
+    size_t out_cap;
+    int refs;                   // 事件循环持有1个，每个未完成的请求持有1个
+    int closed;                 // 连接已关闭，响应直接丢弃
+    int want_out;               // 是否已关注 EPOLLOUT
+    pthread_mutex_t lock;
+} conn_t;
+
+typedef struct request {
+    conn_t *conn;
+    nfs_req_t *req;             // 整个请求帧
+} request_t;
+
+static int epfd = -1;
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig){
+    stop = 1;
+}
+
+static int set_nonblock(int fd){
+    int flags = fcntl(fd,F_GETFL);
+    return flags<0 ? -1 : fcntl(fd,F_SETFL,flags | O_NONBLOCK);
+}
+
+static int grow(char **buf,size_t *cap,size_t need){
+    if(need<=*cap){
+        return 0;
+    }
+    size_t cap2 = *cap ? *cap : 4096;
+    while(cap2<need){
+        cap2 *= 2;
+    }
+    char *p = (char*)realloc(*buf,cap2);
+    if(p==NULL){
+        return -1;
+    }
+    *buf = p;
+    *cap = cap2;
+    return 0;
+}
+
+static void conn_put(conn_t *c){
+    pthread_mutex_lock(&c->lock);
+    int last = --c->refs==0;
+    pthread_mutex_unlock(&c->lock);
+    if(last){
+        pthread_mutex_destroy(&c->lock);
+        free(c->in);
+        free(c->out);
+        free(c);
+    }
+}
+
+/**
+ * @brief 关闭连接，未完成的请求执行完后由最后一个 conn_put 释放
+ */
+static void conn_close(conn_t *c){
+    pthread_mutex_lock(&c->lock);
+    if(!c->closed){
+        c->closed = 1;
+        epoll_ctl(epfd,EPOLL_CTL_DEL,c->fd,NULL);
+        close(c->fd);
+    }
+    pthread_mutex_unlock(&c->lock);
+    conn_put(c);
+}
+
+/**
+ * @brief 尽量发出发送缓冲中的数据，调用者持有 c->lock
+ * @return 成功返回0，连接出错返回-1
+ */
+static int flush_locked(conn_t *c){
+    size_t done = 0;
+    while(done<c->out_len){
+        ssize_t n = send(c->fd,c->out+done,c->out_len-done,MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n<0){
+            if(errno==EINTR){
+                continue;
+            }
+            if(errno==EAGAIN || errno==EWOULDBLOCK){
+                break;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    memmove(c->out,c->out+done,c->out_len-done);
+    c->out_len -= done;
+
+    int want_out = c->out_len>0;
+    if(want_out!=c->want_out){
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epfd,EPOLL_CTL_MOD,c->fd,&ev);
+        c->want_out = want_out;
+    }
+    return 0;
+}
+
+/**
+ * @brief 工作线程发送一个响应帧
+ */
+static void conn_send(conn_t *c,nfs_resp_t *resp){
+    pthread_mutex_lock(&c->lock);
+    if(!c->closed && grow(&c->out,&c->out_cap,c->out_len+resp->len)==0){
+        memcpy(c->out+c->out_len,resp,resp->len);
+        c->out_len += resp->len;
+        flush_locked(c);    // 出错时由事件循环在下一次读时发现并关闭
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+typedef struct dirent_buf {
+    nfs_resp_t *resp;
+    size_t cap;
+} dirent_buf_t;
+
+static int put_dirent(const nfs_dirent_t *ent,void *arg){
+    dirent_buf_t *b = (dirent_buf_t*)arg;
+    nfs_wire_dirent_t w;
+    w.ino = ent->ino;
+    w.type = ent->type;
+    w.name_len = strlen(ent->name);
+    size_t need = b->resp->len + sizeof(w) + w.name_len;
+    if(need>NFS_PROTO_MAX_FRAME){
+        return -EFBIG;
+    }
+    if(grow((char**)&b->resp,&b->cap,need)<0){
+        return -ENOMEM;
+    }
+    char *p = (char*)b->resp + b->resp->len;
+    memcpy(p,&w,sizeof(w));
+    memcpy(p+sizeof(w),ent->name,w.name_len);
+    b->resp->len = need;
+    return 0;
+}
+
+/**
+ * @brief 执行一个请求并返回响应帧，由调用者 free
+ */
+static nfs_resp_t* execute(nfs_req_t *req){
+    size_t payload = req->len - sizeof(nfs_req_t);
+    const char *body = (const char*)(req+1);
+    size_t cap = sizeof(nfs_resp_t);
+    if(req->op==NFS_OP_READ){
+        cap += req->count<NFS_PROTO_MAX_FRAME-cap ? req->count : NFS_PROTO_MAX_FRAME-cap;
+    } else if(req->op==NFS_OP_STAT){
+        cap += sizeof(nfs_stat_t);
+    }
+    nfs_resp_t *resp = (nfs_resp_t*)malloc(cap);
+    char *path = NULL;
+    char *rest = NULL;
+    if(resp==NULL){
+        return NULL;
+    }
+    resp->len = sizeof(nfs_resp_t);
+    resp->tag = req->tag;
+    resp->reserved = 0;
+    if(req->path_len>payload){
+        resp->result = -EINVAL;
+        return resp;
+    }
+    path = strndup(body,req->path_len);
+    rest = strndup(body+req->path_len,payload-req->path_len);
+    if(path==NULL || rest==NULL){
+        resp->result = -ENOMEM;
+        goto out;
+    }
+
+    int r;
+    nfs_ino_t ino;
+    switch(req->op){
+    case NFS_OP_LOOKUP:
+        r = nfs_lookup(path,&ino);
+        if(r==0){
+            r = ino;
+        }
+        break;
+    case NFS_OP_STAT:
+        r = nfs_stat(path,(nfs_stat_t*)(resp+1));
+        if(r==0){
+            resp->len += sizeof(nfs_stat_t);
+        }
+        break;
+    case NFS_OP_MKDIR:
+        r = nfs_mkdir(path);
+        break;
+    case NFS_OP_CREATE:
+        r = nfs_create(path,&ino);
+        if(r==0){
+            r = ino;
+        }
+        break;
+    case NFS_OP_READ:
+        r = nfs_read(req->ino,resp+1,cap-sizeof(nfs_resp_t),req->off);
+        if(r>0){
+            resp->len += r;
+        }
+        break;
+    case NFS_OP_WRITE:
+        r = nfs_write(req->ino,body+req->path_len,payload-req->path_len,req->off);
+        break;
+    case NFS_OP_READDIR: {
+        dirent_buf_t b = {resp,cap};
+        r = nfs_readdir(path,put_dirent,&b);
+        resp = b.resp;
+        if(r<0){
+            resp->len = sizeof(nfs_resp_t);
+        }
+        break;
+    }
+    case NFS_OP_UNLINK:
+        r = nfs_unlink(path);
+        break;
+    case NFS_OP_RMDIR:
+        r = nfs_rmdir(path);
+        break;
+    case NFS_OP_REMOVE_TREE:
+        r = nfs_remove_tree(path);
+        break;
+    case NFS_OP_COPY:
+        r = nfs_copy(path,rest);
+        break;
+    case NFS_OP_SNAPSHOT_CREATE:
+        r = nfs_snapshot_create(path);
+        break;
+    case NFS_OP_SNAPSHOT_DELETE:
+        r = nfs_snapshot_delete(path);
+        break;
+    default:
+        r = -ENOSYS;
+    }
+    resp->result = r;
+
+out:
+    free(path);
+    free(rest);
+    return resp;
+}
+
+static void handle(void *arg){
+    request_t *t = (request_t*)arg;
+    nfs_resp_t *resp = execute(t->req);
+    if(resp){
+        conn_send(t->conn,resp);
+        free(resp);
+    } else {
+        // 分配不到响应帧时也要回复，否则客户端会一直等这个 tag
+        nfs_resp_t err;
+        err.len = sizeof(nfs_resp_t);
+        err.tag = t->req->tag;
+        err.result = -ENOMEM;
+        err.reserved = 0;
+        conn_send(t->conn,&err);
+    }
+    conn_put(t->conn);
+    free(t->req);
+    free(t);
+}
+
+/**
+ * @brief 读入连接上的数据，把其中的完整请求帧交给线程池
+ * @return 连接正常返回0，对端关闭或出错返回-1
+ */
+static int conn_read(conn_t *c,tpool_t *pool){
+    while(1){
+        if(grow(&c->in,&c->in_cap,c->in_len+4096)<0){
+            return -1;
+        }
+        ssize_t n = recv(c->fd,c->in+c->in_len,c->in_cap-c->in_len,0);
+        if(n==0){
+            return -1;
+        }
+        if(n<0){
+            if(errno==EINTR){
+                continue;
+            }
+            if(errno==EAGAIN || errno==EWOULDBLOCK){
+                break;
+            }
+            return -1;
+        }
+        c->in_len += n;
+    }
+
+    size_t off = 0;
+    while(c->in_len-off>=sizeof(uint32_t)){
+        uint32_t len;
+        memcpy(&len,c->in+off,sizeof(len));
+        if(len<sizeof(nfs_req_t) || len>NFS_PROTO_MAX_FRAME){
+            return -1;      // 帧格式错误，无法再找到下一帧的边界
+        }
+        if(c->in_len-off<len){
+            break;
+        }
+        request_t *t = (request_t*)malloc(sizeof(request_t));
+        nfs_req_t *req = (nfs_req_t*)malloc(len);
+        if(t==NULL || req==NULL){
+            free(t);
+            free(req);
+            return -1;
+        }
+        memcpy(req,c->in+off,len);
+        off += len;
+        t->conn = c;
+        t->req = req;
+        pthread_mutex_lock(&c->lock);
+        c->refs++;
+        pthread_mutex_unlock(&c->lock);
+        if(tpool_submit(pool,handle,t)<0){
+            handle(t);
+        }
+    }
+    memmove(c->in,c->in+off,c->in_len-off);
+    c->in_len -= off;
+    return 0;
+}
+
+static void conn_accept(int lfd){
+    while(1){
+        int fd = accept(lfd,NULL,NULL);
+        if(fd<0){
+            return;
+        }
+        conn_t *c = (conn_t*)calloc(1,sizeof(conn_t));
+        if(c==NULL || set_nonblock(fd)<0){
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->refs = 1;
+        pthread_mutex_init(&c->lock,NULL);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)<0){
+            pthread_mutex_destroy(&c->lock);
+            free(c);
+            close(fd);
+        }
+    }
+}
+
+static int listen_on(const char *path){
+    struct sockaddr_un addr;
+    if(strlen(path)>=sizeof(addr.sun_path)){
+        return -1;
+    }
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd<0){
+        return -1;
+    }
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    unlink(path);
+    if(bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(fd,128)<0 || set_nonblock(fd)<0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *prog){
+    printf("usage: %s [-i image] [-s snapshot] [-d|--discard] [-D|--direct] [-c|--csum] [-S size] [-N inodes] [-t threads] socket\n",prog);
+}
+
+/**
+ * @brief 解析 -S 的参数，可带 K/M/G/T 后缀（以1024为单位）
+ * @return 成功返回字节数，格式不对返回0
+ */
+static uint64_t parse_size(const char *s){
+    char *end;
+    uint64_t n = strtoull(s,&end,10);
+    int shift = 0;
+    switch(*end){
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if(end==s || *end!='\0' || n>(UINT64_MAX>>shift)){
+        return 0;
+    }
+    return n << shift;
+}
+
+int
+main(int argc, char**argv){
+    const char *image = NULL;
+    const char *snapshot = NULL;
+    const char *sock = NULL;
+    int flags = 0;
+    int nthreads = 0;
+    uint64_t size = 0;
+    uint64_t inodes = 0;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-i") && i+1<argc){
+            image = argv[++i];
+        } else if(!strcmp(argv[i],"-s") && i+1<argc){
+            snapshot = argv[++i];
+        } else if(!strcmp(argv[i],"-d") || !strcmp(argv[i],"--discard")){
+            flags |= NFS_MOUNT_DISCARD;
+        } else if(!strcmp(argv[i],"-D") || !strcmp(argv[i],"--direct")){
+            flags |= NFS_MOUNT_DIRECT;
+        } else if(!strcmp(argv[i],"-c") || !strcmp(argv[i],"--csum")){
+            flags |= NFS_MOUNT_CSUM;
+        } else if(!strcmp(argv[i],"-S") && i+1<argc && (size = parse_size(argv[i+1]))>0){
+            i++;
+        } else if(!strcmp(argv[i],"-N") && i+1<argc){
+            inodes = strtoull(argv[++i],NULL,10);
+        } else if(!strcmp(argv[i],"-t") && i+1<argc){
+            nthreads = atoi(argv[++i]);
+        } else if(argv[i][0]!='-' && sock==NULL){
+            sock = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(sock==NULL){
+        usage(argv[0]);
+        return 1;
+    }
+
+    nfs_set_format(size,inodes);
+    int r = nfs_mount(image,snapshot,flags);
+    if(r<0){
+        printf("mount error: %s\n",nfs_strerror(r));
+        return 1;
+    }
+    int lfd = listen_on(sock);
+    epfd = epoll_create1(0);
+    tpool_t *pool = tpool_create(nthreads);
+    if(lfd<0 || epfd<0 || pool==NULL){
+        printf("can not listen on %s: %s\n",sock,strerror(errno));
+        nfs_unmount();
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    signal(SIGPIPE,SIG_IGN);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         // data.ptr 为NULL表示监听的 socket
+    epoll_ctl(epfd,EPOLL_CTL_ADD,lfd,&ev);
+    printf("serving on %s\n",sock);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    while(!stop){
+        int n = epoll_wait(epfd,events,64,-1);
+        for(int i=0;i<n;i++){
+            conn_t *c = (conn_t*)events[i].data.ptr;
+            if(c==NULL){
+                conn_accept(lfd);
+                continue;
+            }
+            if(events[i].events & EPOLLOUT){
+                pthread_mutex_lock(&c->lock);
+                int err = !c->closed && flush_locked(c)<0;
+                pthread_mutex_unlock(&c->lock);
+                if(err){
+                    conn_close(c);
+                    continue;
+                }
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                if(conn_read(c,pool)<0){
+                    conn_close(c);
+                }
+            }
+        }
+    }
+
+    // 等未完成的请求执行完再卸载；仍连着的客户端随进程退出断开
+    tpool_destroy(pool);
+    close(lfd);
+    unlink(sock);
+    r = nfs_unmount();
+    if(r<0){
+        printf("unmount error: %s\n",nfs_strerror(r));
+        return 1;
+    }
+    return 0;
+}
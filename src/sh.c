@@ -1,52 +1,367 @@
 #include "util.h"
 #include "sh.h"
-#include "filesys.h"
-#include "disk.h"
+#include "naivefs.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fnmatch.h>
 
 
 char whitespace[] = " \t\r\n\v";
-char args[MAXARGS][MAXWORD];
 
-int getcmd(char *buf, int nbuf){
+/**
+ * @brief 读入一行命令，行的长度不限，*buf 按需扩大
+ * @return 成功返回0，EOF 返回-1
+ */
+int getcmd(char **buf,size_t *cap){
     printf("=> ");
-    memset(buf,0,nbuf);
-    gets(buf,nbuf);
+    fflush(stdout);
+    if(getline(buf,cap,stdin)<0) //EOF
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief 把 cmd 按空白切分为若干个词，*argv 依次指向各个词并以NULL结尾，按需扩大
+ * @return 成功返回词的个数，内存不足返回-1
+ */
+int getargs(char *cmd,char ***argv,int *cap){
+    int argc = 0;
+    char *p = cmd;
+    while(1){
+        // 跳过空白，让 argv[argc] 指向下一个词的开头，并把词后面的空白设为'\0'
+        while(*p && strchr(whitespace,*p)){
+            p++;
+        }
+        if(argc+1>=*cap){   // 留出结尾的NULL
+            int n = *cap ? *cap*2 : 8;
+            char **tmp = (char**)realloc(*argv,sizeof(char*) * n);
+            if(tmp==NULL){
+                return -1;
+            }
+            *argv = tmp;
+            *cap = n;
+        }
+        if(*p=='\0'){
+            break;
+        }
+        (*argv)[argc++] = p;
+        while(*p && !strchr(whitespace,*p)){
+            p++;
+        }
+        if(*p){
+            *p++ = '\0';
+        }
+    }
+    (*argv)[argc] = NULL;
+    return argc;
+}
+
+/*
+ * 以下各命令只通过 naivefs.h 中的接口访问文件系统
+ */
+
+static int print_dirent(const nfs_dirent_t *ent,void *arg){
+    if(ent->type == NFS_TYPE_DIR){
+        printf("[%s]\n",ent->name);
+    }
+    else{
+        printf("%s\n",ent->name);
+    }
+    return 0;
+}
+
+static void print_stat(const nfs_stat_t *st,const char *name){
+    printf("%c %3u %8lu %3u  %s\n",st->type == NFS_TYPE_DIR ? 'd' : '-',
+        st->link,(unsigned long)st->size,st->blocks,name);
+}
 
-    if(buf[0]==0) //EOF
+static int print_dirent_stat(const nfs_dirent_t *ent,const nfs_stat_t *st,void *arg){
+    print_stat(st,ent->name);
+    return 0;
+}
+
+/**
+ * @brief 执行 ls [-l] [path] 展示读取文件夹内容
+ *        -l 时每行依次为类型、连接数、大小（字节）、占用的数据块数和名字
+ */
+int exec_ls(char *argv[],int argc){
+    int lflag = 0;
+    char *path = "/";
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-l")){
+            lflag = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    int r = lflag ? nfs_readdir_stat(path,print_dirent_stat,NULL)
+                  : nfs_readdir(path,print_dirent,NULL);
+    if(r<0){
+        printf("Can not find directory %s: %s\n",path,nfs_strerror(r));
         return -1;
+    }
     return 0;
 }
 
-void getargs(char *cmd,char *argv[],int *argc){
-    // argv存放各个参数的指针
-    for(int i=0;i<MAXARGS;i++){
-        argv[i] = &args[i][0];
+/**
+ * @brief 执行 mkdir 创建文件夹
+ */
+int exec_mkdir(char *argv[],int argc){
+    if(argc<2){
+        printf("Too few arguments!\n");
+        return -1;
     }
+    int r = nfs_mkdir(argv[1]);
+    if(r<0){
+        printf("mkdir \"%s\": %s\n",argv[1],nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
 
-    int i = 0; // 表示第i个word
-    int j = 0;
-    for (; cmd[j] != '\n' && cmd[j] != '\0'; j++)
-    {
-        // 每一轮循环都是找到输入的命令中的一个word，比如 echo hi ,就是先找到echo，再找到hi
-        // 让argv[i]分别指向他们的开头，并且将echo，hi后面的空格设为\0
-        // 跳过之前的空格
-        while (strchr(whitespace,cmd[j])){
-            j++;
+/**
+ * @brief 执行 touch 创建文件
+ */
+int exec_touch(char *argv[],int argc){
+    if(argc<2){
+        printf("Too few arguments!\n");
+        return -1;
+    }
+    int r = nfs_create(argv[1],NULL);
+    if(r<0){
+        printf("touch \"%s\": %s\n",argv[1],nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 执行 cp [-r] src dst 复制文件或目录树
+ */
+int exec_cp(char *argv[],int argc){
+    int recursive = 0;
+    char *paths[2];
+    int npath = 0;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-r")){
+            recursive = 1;
+        } else if(npath<2){
+            paths[npath++] = argv[i];
+        } else {
+            npath++;
         }
-        argv[i++]=cmd+j;
-        // 只要不是空格，就j++,找到下一个空格
-        while (strchr(whitespace,cmd[j])==0){
-            j++;
+    }
+    if(npath!=2){
+        printf("arguments wrong!\n");
+        return -1;
+    }
+
+    // 不带 -r 时只能复制文件
+    nfs_stat_t st;
+    int r = nfs_stat(paths[0],&st);
+    if(r==0 && st.type==NFS_TYPE_DIR && !recursive){
+        r = -EISDIR;
+    }
+    if(r==0){
+        r = nfs_copy(paths[0],paths[1]);
+    }
+    if(r<0){
+        printf("cp \"%s\" \"%s\": %s\n",paths[0],paths[1],nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 执行 rm [-r] 删除文件或整棵目录树
+ */
+int exec_rm(char *argv[],int argc){
+    int recursive = 0;
+    char *path = NULL;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-r")){
+            recursive = 1;
+        } else {
+            path = argv[i];
         }
-        cmd[j]='\0';
     }
+    if(path==NULL){
+        printf("Too few arguments!\n");
+        return -1;
+    }
+    int r = recursive ? nfs_remove_tree(path) : nfs_unlink(path);
+    if(r<0){
+        printf("rm \"%s\": %s\n",path,nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
 
-    argv[i]=0;
-    *argc=i;
+/**
+ * @brief 执行 rmdir 删除空目录
+ */
+int exec_rmdir(char *argv[],int argc){
+    if(argc<2){
+        printf("Too few arguments!\n");
+        return -1;
+    }
+    int r = nfs_rmdir(argv[1]);
+    if(r<0){
+        printf("rmdir \"%s\": %s\n",argv[1],nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+static int print_du(const char *path,const nfs_stat_t *st,uint64_t total,void *arg){
+    int all = *(int*)arg;
+    if(all || st->type==NFS_TYPE_DIR){
+        printf("%lu\t%s\n",(unsigned long)(total * st->block_size / 1024),path);
+    }
+    return 0;
+}
+
+/**
+ * @brief 执行 du [-a] [path] 统计目录树的空间占用
+ */
+int exec_du(char *argv[],int argc){
+    int all = 0;
+    char *path = "/";
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-a")){
+            all = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    int r = nfs_walk(path,print_du,&all);
+    if(r<0){
+        printf("du \"%s\": %s\n",path,nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 执行 stat path... 展示文件或目录的属性，格式同 ls -l
+ */
+int exec_stat(char *argv[],int argc){
+    if(argc<2){
+        printf("Too few arguments!\n");
+        return -1;
+    }
+    int ret = 0;
+    for(int i=1;i<argc;i++){
+        nfs_stat_t st;
+        int r = nfs_stat(argv[i],&st);
+        if(r<0){
+            printf("stat \"%s\": %s\n",argv[i],nfs_strerror(r));
+            ret = -1;
+            continue;
+        }
+        print_stat(&st,argv[i]);
+    }
+    return ret;
+}
+
+typedef struct find_arg {
+    char *pattern;
+    int type;
+} find_arg_t;
+
+static int print_find(const char *path,const nfs_stat_t *st,uint64_t total,void *arg){
+    find_arg_t *f = (find_arg_t*)arg;
+    if(f->type>=0 && st->type!=(uint32_t)f->type){
+        return 0;
+    }
+    const char *name = strrchr(path,'/');
+    name = (name && name[1]) ? name+1 : path;
+    if(f->pattern && fnmatch(f->pattern,name,0)!=0){
+        return 0;
+    }
+    printf("%s\n",path);
+    return 0;
+}
+
+/**
+ * @brief 执行 find [path] [-name pattern] [-type f|d] 查找文件
+ */
+int exec_find(char *argv[],int argc){
+    char *path = "/";
+    find_arg_t f = {NULL,-1};
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"-name") && i+1<argc){
+            f.pattern = argv[++i];
+        } else if(!strcmp(argv[i],"-type") && i+1<argc){
+            i++;
+            if(!strcmp(argv[i],"f")){
+                f.type = NFS_TYPE_FILE;
+            } else if(!strcmp(argv[i],"d")){
+                f.type = NFS_TYPE_DIR;
+            } else {
+                printf("Unknown type \"%s\"\n",argv[i]);
+                return -1;
+            }
+        } else if(argv[i][0]=='-'){
+            printf("Unknown option \"%s\"\n",argv[i]);
+            return -1;
+        } else {
+            path = argv[i];
+        }
+    }
+    int r = nfs_walk(path,print_find,&f);
+    if(r<0){
+        printf("find \"%s\": %s\n",path,nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+static int print_snapshot(const char *name,uint64_t size,int mounted,void *arg){
+    printf("%s\t%luK%s\n",name,(unsigned long)(size / 1024),mounted ? "\t(mounted)" : "");
+    return 0;
+}
+
+/**
+ * @brief 执行 snapshot：
+ *        snapshot            列出所有快照及其已复制的数据量
+ *        snapshot <name>     冻结当前的块占用位图，创建快照
+ *        snapshot -d <name>  删除快照
+ */
+int exec_snapshot(char *argv[],int argc){
+    int r;
+    if(argc==1){
+        r = nfs_snapshot_list(print_snapshot,NULL);
+    } else if(argc==3 && !strcmp(argv[1],"-d")){
+        r = nfs_snapshot_delete(argv[2]);
+    } else if(argc==2){
+        r = nfs_snapshot_create(argv[1]);
+    } else {
+        printf("arguments wrong!\n");
+        return -1;
+    }
+    if(r<0){
+        printf("snapshot: %s\n",nfs_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 卸载文件系统并退出
+ */
+void exec_shutdown(){
+    printf("Shutting down file system...\n");
+    if(nfs_unmount()<0){
+        printf("shutdown error!\n");
+    }
+    nfs_trace_stop();
+    printf("Goodbye!\n");
+    sleep(1);
+    exit(0);
 }
 
 int runcmd(char *argv[],int argc){
@@ -55,6 +370,21 @@ int runcmd(char *argv[],int argc){
     //     printf("%d:%s ",i,argv[i]);
     // }
     // printf("\n");
+
+    // 记录 trace 时先记下命令行，便于对照命令和它产生的操作
+    size_t size = 1;
+    for(int i=0;i<argc;i++){
+        size += strlen(argv[i]) + 1;
+    }
+    char *line = (char*)malloc(size);
+    if(line){
+        size_t len = 0;
+        for(int i=0;i<argc;i++){
+            len += snprintf(line+len,size-len,i ? " %s" : "%s",argv[i]);
+        }
+        nfs_trace_note(line);
+        free(line);
+    }
     
     if(!strcmp(argv[0],"ls")){
         exec_ls(argv,argc);
@@ -68,8 +398,26 @@ int runcmd(char *argv[],int argc){
     else if(!strcmp(argv[0],"cp")){
         exec_cp(argv,argc);
     }
+    else if(!strcmp(argv[0],"rm")){
+        exec_rm(argv,argc);
+    }
+    else if(!strcmp(argv[0],"rmdir")){
+        exec_rmdir(argv,argc);
+    }
+    else if(!strcmp(argv[0],"du")){
+        exec_du(argv,argc);
+    }
+    else if(!strcmp(argv[0],"find")){
+        exec_find(argv,argc);
+    }
+    else if(!strcmp(argv[0],"stat")){
+        exec_stat(argv,argc);
+    }
+    else if(!strcmp(argv[0],"snapshot")){
+        exec_snapshot(argv,argc);
+    }
     else if(!strcmp(argv[0],"shutdown")){
-        shutdown_filesys();
+        exec_shutdown();
     } else {
         printf("can not parse command.\n");
         return -1;
@@ -82,22 +430,32 @@ int runcmd(char *argv[],int argc){
 
 
 
-void run_shell(){
+void run_shell(const char *snapshot,int flags){
 
     printf("booting shell... \n");
+    int r = nfs_mount(NULL,snapshot,flags);
+    if(r<0){
+        printf("mount error: %s\n",nfs_strerror(r));
+        return;
+    }
     printf("shell booted!\n");
 
-    init_filesystem();
+    char *buf = NULL;
+    size_t cap = 0;
+    char **argv = NULL;
+    int argv_cap = 0;
 
-    char buf[MAXLINE];
-
-    //  持续读命令
-    while(getcmd(buf,MAXLINE) >= 0) {
-        char* argv[MAXARGS];
-        int argc = -1;
-        getargs(buf,argv,&argc);
-        runcmd(argv,argc);
+    //  持续读命令，空行跳过
+    while(getcmd(&buf,&cap) >= 0) {
+        int argc = getargs(buf,&argv,&argv_cap);
+        if(argc<0){
+            printf("out of memory\n");
+        } else if(argc>0){
+            runcmd(argv,argc);
+        }
     }
+    free(buf);
+    free(argv);
 
-    shutdown_filesys();
-}
\ No newline at end of file
+    exec_shutdown();
+}
@@ -0,0 +1,432 @@
+#include "disk.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SNAP_MAGIC 0x534e4150   // "SNAP"
+#define SNAP_CHUNK 65536        // bytes of a block map read in at once
+
+typedef struct snap_header {
+        uint32_t magic;
+        uint32_t nblocks;       // number of disk blocks covered
+        uint32_t nslots;        // number of slots in use
+        uint32_t map_offset;    // first disk-block-sized unit of the overlay map
+        uint32_t data_offset;   // first disk-block-sized unit of the slots
+        char name[SNAPSHOT_NAME_MAX + 1];
+} snap_header_t;
+
+// A block map kept in the snapshot file and read in SNAP_CHUNK bytes at a
+// time, on first use. Chunks never used are never read or allocated, so
+// opening a snapshot costs the same whatever the size of the disk.
+typedef struct snap_map {
+        off_t offset;           // where the map starts in the snapshot file
+        size_t size;            // bytes
+        size_t nchunks;
+        char** chunks;          // NULL until read in
+} snap_map_t;
+
+typedef struct snapshot {
+        snap_header_t hdr;
+        int fd;
+        snap_map_t shared;      // frozen block map
+        snap_map_t map;         // overlay block map, slot + 1 or 0 per block
+} snapshot_t;
+
+static snapshot_t snaps[MAX_SNAPSHOTS];
+static int nsnaps;
+static snapshot_t* view;        // mounted snapshot, NULL for the live view
+static char view_name[SNAPSHOT_NAME_MAX + 1];
+static char* image;             // path of the image the snapshots belong to
+// Held while a block is preserved or a slot is allocated; the tree walker
+// writes blocks from several threads.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int valid_name(const char* name)
+{
+        size_t len = strlen(name);
+        if(len == 0 || len > SNAPSHOT_NAME_MAX){
+                return 0;
+        }
+        for(size_t i = 0; i < len; i++){
+                char c = name[i];
+                if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                     || (c >= '0' && c <= '9') || c == '_' || c == '-')){
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+// Returns the path of the snapshot file, to be freed by the caller, or NULL.
+static char* snap_path(const char* name)
+{
+        size_t size = strlen(image) + strlen(".snap.") + strlen(name) + 1;
+        char* path = (char*)malloc(size);
+        if(path != NULL){
+                snprintf(path, size, "%s.snap.%s", image, name);
+        }
+        return path;
+}
+
+static unsigned int nblocks()
+{
+        return disk_nblocks();
+}
+
+static unsigned int units(size_t bytes)
+{
+        return (bytes + DEVICE_BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE;
+}
+
+static int map_init(snap_map_t* m, off_t offset, size_t size)
+{
+        m->offset = offset;
+        m->size = size;
+        m->nchunks = (size + SNAP_CHUNK - 1) / SNAP_CHUNK;
+        m->chunks = (char**)calloc(m->nchunks > 0 ? m->nchunks : 1, sizeof(char*));
+        return m->chunks ? 0 : -1;
+}
+
+static void map_free(snap_map_t* m)
+{
+        for(size_t i = 0; m->chunks != NULL && i < m->nchunks; i++){
+                free(m->chunks[i]);
+        }
+        free(m->chunks);
+        memset(m, 0, sizeof(snap_map_t));
+}
+
+/**
+ * Return a pointer to byte off of map m, reading its chunk from fd first
+ * if needed, or NULL if the chunk cannot be read. Caller holds lock.
+ */
+static char* map_at(int fd, snap_map_t* m, size_t off)
+{
+        size_t c = off / SNAP_CHUNK;
+        if(m->chunks[c] == NULL){
+                size_t len = m->size - c * SNAP_CHUNK < SNAP_CHUNK ? m->size - c * SNAP_CHUNK : SNAP_CHUNK;
+                char* chunk = (char*)malloc(SNAP_CHUNK);
+                if(chunk == NULL || pread(fd, chunk, len, m->offset + (off_t)c * SNAP_CHUNK) != (ssize_t)len){
+                        free(chunk);
+                        return NULL;
+                }
+                m->chunks[c] = chunk;
+        }
+        return m->chunks[c] + off % SNAP_CHUNK;
+}
+
+// Returns 1 if block_num is in the frozen map of s, 0 if not, -1 on error.
+static int shared_test(snapshot_t* s, unsigned int block_num)
+{
+        unsigned char* byte = (unsigned char*)map_at(s->fd, &s->shared, block_num / 8);
+        if(byte == NULL){
+                return -1;
+        }
+        return (*byte & (0x80 >> (block_num % 8))) != 0;
+}
+
+// Returns the overlay map entry of block_num, or NULL on error.
+static uint32_t* map_entry(snapshot_t* s, unsigned int block_num)
+{
+        return (uint32_t*)map_at(s->fd, &s->map, (size_t)block_num * sizeof(uint32_t));
+}
+
+static void free_snap(snapshot_t* s)
+{
+        if(s->fd != -1){
+                close(s->fd);
+        }
+        map_free(&s->shared);
+        map_free(&s->map);
+        memset(s, 0, sizeof(snapshot_t));
+        s->fd = -1;
+}
+
+// Points the maps of s at their place in the file described by s->hdr.
+static int init_maps(snapshot_t* s)
+{
+        if(map_init(&s->shared, DEVICE_BLOCK_SIZE, ((size_t)s->hdr.nblocks + 7) / 8) < 0
+           || map_init(&s->map, (off_t)s->hdr.map_offset * DEVICE_BLOCK_SIZE,
+                       (size_t)s->hdr.nblocks * sizeof(uint32_t)) < 0){
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * Open a snapshot file. Only the header is read; the maps are read in as
+ * they are used.
+ */
+static int load_snap(snapshot_t* s, const char* path)
+{
+        memset(s, 0, sizeof(snapshot_t));
+        s->fd = open(path, O_RDWR);
+        if(s->fd == -1){
+                return -1;
+        }
+        if(pread(s->fd, &s->hdr, sizeof(s->hdr), 0) != sizeof(s->hdr)
+           || s->hdr.magic != SNAP_MAGIC || s->hdr.nblocks != nblocks()
+           || init_maps(s) < 0){
+                free_snap(s);
+                return -1;
+        }
+        return 0;
+}
+
+static snapshot_t* find_snap(const char* name)
+{
+        for(int i = 0; i < nsnaps; i++){
+                if(!strcmp(snaps[i].hdr.name, name)){
+                        return &snaps[i];
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Append buf as a new slot of s and point block_num at it. Caller holds lock.
+ */
+static int add_slot(snapshot_t* s, unsigned int block_num, char* buf)
+{
+        uint32_t* map = map_entry(s, block_num);
+        if(map == NULL){
+                return -1;
+        }
+        uint32_t slot = s->hdr.nslots;
+        off_t off = (off_t)(s->hdr.data_offset + slot) * DEVICE_BLOCK_SIZE;
+        if(pwrite(s->fd, buf, DEVICE_BLOCK_SIZE, off) != DEVICE_BLOCK_SIZE){
+                return -1;
+        }
+        // data before the map entry, map entry before the header
+        uint32_t entry = slot + 1;
+        off = (off_t)s->hdr.map_offset * DEVICE_BLOCK_SIZE + (off_t)block_num * sizeof(uint32_t);
+        if(pwrite(s->fd, &entry, sizeof(entry), off) != sizeof(entry)){
+                return -1;
+        }
+        s->hdr.nslots++;
+        if(pwrite(s->fd, &s->hdr, sizeof(s->hdr), 0) != sizeof(s->hdr)){
+                s->hdr.nslots--;
+                return -1;
+        }
+        *map = entry;
+        return 0;
+}
+
+int snapshot_use(const char* name)
+{
+        if(name == NULL){
+                view_name[0] = '\0';
+                return 0;
+        }
+        if(!valid_name(name)){
+                return -1;
+        }
+        strcpy(view_name, name);
+        return 0;
+}
+
+const char* snapshot_view()
+{
+        return view ? view->hdr.name : NULL;
+}
+
+int snapshot_open(const char* path)
+{
+        glob_t g;
+        free(image);
+        image = strdup(path);
+        char* pattern = image ? snap_path("*") : NULL;
+        if(pattern == NULL){
+                return -1;
+        }
+        nsnaps = 0;
+        view = NULL;
+        if(glob(pattern, 0, NULL, &g) == 0){
+                for(size_t i = 0; i < g.gl_pathc && nsnaps < MAX_SNAPSHOTS; i++){
+                        if(load_snap(&snaps[nsnaps], g.gl_pathv[i]) == 0){
+                                nsnaps++;
+                        }
+                }
+                globfree(&g);
+        }
+        free(pattern);
+        if(view_name[0] != '\0'){
+                view = find_snap(view_name);
+                if(view == NULL){
+                        snapshot_close();
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+void snapshot_close()
+{
+        for(int i = 0; i < nsnaps; i++){
+                free_snap(&snaps[i]);
+        }
+        nsnaps = 0;
+        view = NULL;
+        free(image);
+        image = NULL;
+}
+
+int snapshot_create(const char* name, const unsigned char* shared)
+{
+        if(view != NULL || !valid_name(name) || find_snap(name) != NULL || nsnaps == MAX_SNAPSHOTS){
+                return -1;
+        }
+        char* path = snap_path(name);
+        if(path == NULL){
+                return -1;
+        }
+        snapshot_t* s = &snaps[nsnaps];
+        memset(s, 0, sizeof(snapshot_t));
+        s->hdr.magic = SNAP_MAGIC;
+        s->hdr.nblocks = nblocks();
+        s->hdr.nslots = 0;
+        unsigned int shared_units = units(((size_t)s->hdr.nblocks + 7) / 8);
+        s->hdr.map_offset = 1 + shared_units;
+        s->hdr.data_offset = s->hdr.map_offset + units((size_t)s->hdr.nblocks * sizeof(uint32_t));
+        strcpy(s->hdr.name, name);
+
+        s->fd = -1;
+        if(init_maps(s) < 0 || (s->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1){
+                free_snap(s);
+                free(path);
+                return -1;
+        }
+        // The maps are read back in as they are used. The overlay map
+        // starts out all zero; leave it as a hole.
+        size_t shared_size = s->shared.size;
+        if(pwrite(s->fd, shared, shared_size, DEVICE_BLOCK_SIZE) != (ssize_t)shared_size
+           || ftruncate(s->fd, (off_t)s->hdr.data_offset * DEVICE_BLOCK_SIZE) != 0
+           || pwrite(s->fd, &s->hdr, sizeof(s->hdr), 0) != sizeof(s->hdr)){
+                free_snap(s);
+                unlink(path);
+                free(path);
+                return -1;
+        }
+        free(path);
+        nsnaps++;
+        return 0;
+}
+
+int snapshot_delete(const char* name)
+{
+        snapshot_t* s = find_snap(name);
+        if(s == NULL || s == view){
+                return -1;
+        }
+        char* path = snap_path(name);
+        if(path == NULL || unlink(path) != 0){
+                free(path);
+                return -1;
+        }
+        free(path);
+        pthread_mutex_lock(&lock);
+        free_snap(s);
+        int i = s - snaps;
+        memmove(&snaps[i], &snaps[i + 1], sizeof(snapshot_t) * (nsnaps - i - 1));
+        nsnaps--;
+        if(view != NULL){
+                view = find_snap(view_name);
+        }
+        pthread_mutex_unlock(&lock);
+        return 0;
+}
+
+int snapshot_list(char names[][SNAPSHOT_NAME_MAX + 1], int max)
+{
+        for(int i = 0; i < nsnaps && i < max; i++){
+                strcpy(names[i], snaps[i].hdr.name);
+        }
+        return nsnaps;
+}
+
+int snapshot_size(const char* name)
+{
+        snapshot_t* s = find_snap(name);
+        return s ? (int)s->hdr.nslots : -1;
+}
+
+int snapshot_preserve(unsigned int block_num, unsigned int count)
+{
+        char buf[DEVICE_BLOCK_SIZE];
+        int r = 0;
+        if(nsnaps == 0){
+                return 0;
+        }
+        pthread_mutex_lock(&lock);
+        for(unsigned int b = block_num; b < block_num + count && r == 0; b++){
+                int loaded = 0;
+                for(int i = 0; i < nsnaps; i++){
+                        snapshot_t* s = &snaps[i];
+                        int frozen = shared_test(s, b);
+                        uint32_t* map = frozen > 0 ? map_entry(s, b) : NULL;
+                        if(frozen < 0 || (frozen > 0 && map == NULL)){
+                                r = -1;
+                                break;
+                        }
+                        if(!frozen || *map != 0){
+                                continue;
+                        }
+                        if(!loaded && disk_read_raw(b, buf) < 0){
+                                r = -1;
+                                break;
+                        }
+                        loaded = 1;
+                        if(add_slot(s, b, buf) < 0){
+                                r = -1;
+                                break;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&lock);
+        return r;
+}
+
+int snapshot_read_block(unsigned int block_num, char* buf)
+{
+        pthread_mutex_lock(&lock);
+        uint32_t* map = map_entry(view, block_num);
+        uint32_t entry = map ? *map : 0;
+        pthread_mutex_unlock(&lock);
+        if(map == NULL){
+                return -1;
+        }
+        if(entry == 0){
+                return disk_read_raw(block_num, buf);
+        }
+        off_t off = (off_t)(view->hdr.data_offset + entry - 1) * DEVICE_BLOCK_SIZE;
+        if(pread(view->fd, buf, DEVICE_BLOCK_SIZE, off) != DEVICE_BLOCK_SIZE){
+                return -1;
+        }
+        return 0;
+}
+
+int snapshot_write_block(unsigned int block_num, char* buf)
+{
+        int r = 0;
+        pthread_mutex_lock(&lock);
+        uint32_t* map = map_entry(view, block_num);
+        uint32_t entry = map ? *map : 0;
+        if(map == NULL){
+                r = -1;
+        } else if(entry == 0){
+                r = add_slot(view, block_num, buf);
+        } else {
+                off_t off = (off_t)(view->hdr.data_offset + entry - 1) * DEVICE_BLOCK_SIZE;
+                if(pwrite(view->fd, buf, DEVICE_BLOCK_SIZE, off) != DEVICE_BLOCK_SIZE){
+                        r = -1;
+                }
+        }
+        pthread_mutex_unlock(&lock);
+        return r;
+}
@@ -0,0 +1,330 @@
+#include "tpool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct task {
+    task_fn fn;
+    void *arg;
+    tpool_group_t *group;           // 所属任务组，可为NULL
+} task_t;
+
+typedef struct deque {              // 环形缓冲实现的双端队列
+    task_t *tasks;
+    int cap;                        // 容量，总为2的幂
+    int top;                        // 偷取端
+    int bottom;                     // 本线程端
+    pthread_mutex_t lock;
+} deque_t;
+
+struct tpool {
+    int nthreads;
+    pthread_t *threads;
+    deque_t *queues;
+    atomic_int queued;              // 所有队列中尚未被取走的任务数
+    atomic_int pending;             // 已提交但尚未执行完的任务数
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t has_task;        // queued 由0变为非0
+    pthread_cond_t all_done;        // pending 变为0
+};
+
+typedef struct worker_arg {
+    tpool_t *pool;
+    int id;
+} worker_arg_t;
+
+// 当前线程在哪个线程池中、是第几号工作线程；非工作线程为 -1
+static __thread tpool_t *self_pool = NULL;
+static __thread int self_id = -1;
+
+static int deque_push(deque_t *q,task_t t){
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom - q->top == q->cap){   // 满了，扩容一倍
+        task_t *tasks = (task_t*)malloc(sizeof(task_t) * q->cap * 2);
+        if(tasks==NULL){
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for(int i=q->top;i<q->bottom;i++){
+            tasks[i & (q->cap*2-1)] = q->tasks[i & (q->cap-1)];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->cap *= 2;
+    }
+    q->tasks[q->bottom & (q->cap-1)] = t;
+    q->bottom++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static int deque_pop(deque_t *q,task_t *t){
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom > q->top){
+        q->bottom--;
+        *t = q->tasks[q->bottom & (q->cap-1)];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static int deque_steal(deque_t *q,task_t *t){
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom > q->top){
+        *t = q->tasks[q->top & (q->cap-1)];
+        q->top++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/**
+ * @brief 取一个任务：先取自己队列的底部，再依次尝试偷其他队列的顶部
+ * @return 取到返回1，否则返回0
+ */
+static int take_task(tpool_t *pool,int id,task_t *t){
+    if(deque_pop(&pool->queues[id],t)){
+        return 1;
+    }
+    for(int i=1;i<pool->nthreads;i++){
+        if(deque_steal(&pool->queues[(id+i) % pool->nthreads],t)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 执行一个已从队列中取出的任务，并更新线程池和任务组的计数
+ */
+static void run_task(tpool_t *pool,task_t *t){
+    atomic_fetch_sub(&pool->queued,1);
+    t->fn(t->arg);
+    tpool_group_t *g = t->group;
+    if(g){
+        pthread_mutex_lock(&g->lock);
+        if(--g->pending==0){
+            pthread_cond_broadcast(&g->done);
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    if(atomic_fetch_sub(&pool->pending,1)==1){
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void* worker(void *p){
+    worker_arg_t *warg = (worker_arg_t*)p;
+    tpool_t *pool = warg->pool;
+    int id = warg->id;
+    free(warg);
+    self_pool = pool;
+    self_id = id;
+
+    while(1){
+        task_t t;
+        if(take_task(pool,id,&t)){
+            run_task(pool,&t);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while(atomic_load(&pool->queued)==0 && !pool->shutdown){
+            pthread_cond_wait(&pool->has_task,&pool->lock);
+        }
+        int stop = pool->shutdown && atomic_load(&pool->queued)==0;
+        pthread_mutex_unlock(&pool->lock);
+        if(stop){
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 停止已启动的前 nthreads 个工作线程，释放线程池的全部资源
+ */
+static void pool_free(tpool_t *pool,int nthreads){
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->has_task);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i=0;i<nthreads;i++){
+        pthread_join(pool->threads[i],NULL);
+    }
+    for(int i=0;i<pool->nthreads;i++){
+        free(pool->queues[i].tasks);
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_task);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->threads);
+    free(pool->queues);
+    free(pool);
+}
+
+tpool_t* tpool_create(int nthreads){
+    if(nthreads<=0){
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(nthreads<=0){
+            nthreads = 1;
+        }
+    }
+    tpool_t *pool = (tpool_t*)calloc(1,sizeof(tpool_t));
+    if(pool==NULL){
+        return NULL;
+    }
+    pool->nthreads = nthreads;
+    pool->threads = (pthread_t*)calloc(nthreads,sizeof(pthread_t));
+    pool->queues = (deque_t*)calloc(nthreads,sizeof(deque_t));
+    if(pool->threads==NULL || pool->queues==NULL){
+        free(pool->threads);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    atomic_init(&pool->queued,0);
+    atomic_init(&pool->pending,0);
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->has_task,NULL);
+    pthread_cond_init(&pool->all_done,NULL);
+    int ok = 1;
+    for(int i=0;i<nthreads;i++){
+        pool->queues[i].cap = 64;
+        pool->queues[i].tasks = (task_t*)malloc(sizeof(task_t) * 64);
+        pthread_mutex_init(&pool->queues[i].lock,NULL);
+        if(pool->queues[i].tasks==NULL){
+            ok = 0;
+        }
+    }
+    if(!ok){
+        pool_free(pool,0);
+        return NULL;
+    }
+    // 线程没有全部启动时先停掉已启动的线程再释放，调用者拿不到只有部分线程的线程池
+    for(int i=0;i<nthreads;i++){
+        worker_arg_t *warg = (worker_arg_t*)malloc(sizeof(worker_arg_t));
+        if(warg==NULL){
+            pool_free(pool,i);
+            return NULL;
+        }
+        warg->pool = pool;
+        warg->id = i;
+        if(pthread_create(&pool->threads[i],NULL,worker,warg)!=0){
+            free(warg);
+            pool_free(pool,i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+static tpool_t *default_pool = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void create_default_pool(){
+    default_pool = tpool_create(0);
+}
+
+tpool_t* tpool_default(){
+    pthread_once(&default_once,create_default_pool);
+    return default_pool;
+}
+
+int tpool_submit(tpool_t *pool,task_fn fn,void *arg){
+    return tpool_submit_group(pool,NULL,fn,arg);
+}
+
+static void group_add(tpool_group_t *g,int delta){
+    pthread_mutex_lock(&g->lock);
+    g->pending += delta;
+    if(g->pending==0){
+        pthread_cond_broadcast(&g->done);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+int tpool_submit_group(tpool_t *pool,tpool_group_t *group,task_fn fn,void *arg){
+    task_t t = {fn,arg,group};
+    // 工作线程派生的子任务放进自己的队列，外部提交的任务轮流分给各个队列
+    static atomic_uint next = 0;
+    int id = (self_pool==pool) ? self_id : (int)(atomic_fetch_add(&next,1) % pool->nthreads);
+
+    if(group){
+        group_add(group,1);
+    }
+    atomic_fetch_add(&pool->pending,1);
+    if(deque_push(&pool->queues[id],t)<0){
+        atomic_fetch_sub(&pool->pending,1);
+        if(group){
+            group_add(group,-1);
+        }
+        return -1;
+    }
+    atomic_fetch_add(&pool->queued,1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->has_task);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void tpool_wait(tpool_t *pool){
+    pthread_mutex_lock(&pool->lock);
+    while(atomic_load(&pool->pending)>0){
+        pthread_cond_wait(&pool->all_done,&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tpool_group_init(tpool_group_t *group){
+    group->pending = 0;
+    pthread_mutex_init(&group->lock,NULL);
+    pthread_cond_init(&group->done,NULL);
+}
+
+void tpool_group_destroy(tpool_group_t *group){
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+void tpool_group_wait(tpool_t *pool,tpool_group_t *group){
+    int helper = (self_pool==pool);
+    pthread_mutex_lock(&group->lock);
+    while(group->pending>0){
+        if(helper){
+            // 工作线程在这里睡眠可能使组内任务无人执行，先取任务来做；
+            // 各队列都空时剩下的任务正在其他线程上执行，完成时会唤醒这里
+            task_t t;
+            pthread_mutex_unlock(&group->lock);
+            int ran = take_task(pool,self_id,&t);
+            if(ran){
+                run_task(pool,&t);
+            }
+            pthread_mutex_lock(&group->lock);
+            if(ran){
+                continue;
+            }
+            if(group->pending==0){
+                break;
+            }
+        }
+        pthread_cond_wait(&group->done,&group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+void tpool_destroy(tpool_t *pool){
+    if(pool==NULL){
+        return;
+    }
+    tpool_wait(pool);
+    pool_free(pool,pool->nthreads);
+}
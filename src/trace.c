@@ -0,0 +1,88 @@
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static atomic_int tracing = 0;      // 不记录时 trace_begin 不加锁
+static uint64_t trace_epoch;        // 开始记录的时间
+
+uint64_t trace_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stop_locked(){
+    int r = 0;
+    atomic_store(&tracing,0);
+    if(trace_file){
+        r = fclose(trace_file)==0 ? 0 : -EIO;
+        trace_file = NULL;
+    }
+    return r;
+}
+
+int trace_start(const char *path){
+    trace_header_t hdr = {TRACE_MAGIC,TRACE_VERSION};
+    pthread_mutex_lock(&trace_lock);
+    stop_locked();
+    trace_file = fopen(path,"wb");
+    if(trace_file==NULL){
+        pthread_mutex_unlock(&trace_lock);
+        return -errno;
+    }
+    if(fwrite(&hdr,sizeof(hdr),1,trace_file)!=1){
+        stop_locked();
+        pthread_mutex_unlock(&trace_lock);
+        return -EIO;
+    }
+    trace_epoch = trace_now();
+    atomic_store(&tracing,1);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int trace_stop(){
+    pthread_mutex_lock(&trace_lock);
+    int r = stop_locked();
+    pthread_mutex_unlock(&trace_lock);
+    return r;
+}
+
+uint64_t trace_begin(){
+    return atomic_load(&tracing) ? trace_now() : 0;
+}
+
+void trace_end(uint64_t begin,int op,const char *path,const char *path2,
+    uint32_t ino,uint64_t off,uint32_t count,int32_t result){
+    if(begin==0){
+        return;
+    }
+    uint64_t end = trace_now();
+    trace_rec_t rec;
+    size_t path_len = path ? strnlen(path,UINT16_MAX) : 0;
+    size_t path2_len = path2 ? strnlen(path2,UINT16_MAX) : 0;
+    memset(&rec,0,sizeof(rec));
+    rec.off = off;
+    rec.latency = end-begin>UINT32_MAX ? UINT32_MAX : end-begin;
+    rec.ino = ino;
+    rec.count = count;
+    rec.result = result;
+    rec.op = op;
+    rec.path_len = path_len;
+    rec.path2_len = path2_len;
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file){
+        rec.ts = begin>trace_epoch ? begin-trace_epoch : 0;
+        fwrite(&rec,sizeof(rec),1,trace_file);
+        fwrite(path,1,path_len,trace_file);
+        fwrite(path2,1,path2_len,trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,321 @@
+#include "util.h"
+#include "filesys.h"
+#include "walk.h"
+#include "tpool.h"
+#include "tree.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/**
+ * @brief 删除目录 parent_id 中名为 name 的项及其整棵子树：
+ *        先摘除目录项，再把子树中所有inode和数据块一次性归还
+ * @return success: 0, fail: 负的错误码
+ */
+static int remove_tree(uint32_t parent_id,const char *name,uint32_t inode_id,const char *path){
+    walk_t w;
+    if(walk_tree(&w,inode_id,path)<0){
+        walk_free(&w);
+        return -EIO;
+    }
+
+    int nblock = 0;
+    int ndir = 0;
+    for(int i=0;i<w.count;i++){
+        nblock += inode_nblock(&w.nodes[i].inode);
+    }
+    uint32_t *inodes = (uint32_t*)malloc(sizeof(uint32_t) * w.count);
+    uint32_t *blocks = (uint32_t*)malloc(sizeof(uint32_t) * (nblock>0 ? nblock : 1));
+    if(inodes==NULL || blocks==NULL){
+        free(inodes);
+        free(blocks);
+        walk_free(&w);
+        return -ENOMEM;
+    }
+    nblock = 0;
+    for(int i=0;i<w.count;i++){
+        inode_t *inode = &w.nodes[i].inode;
+        inodes[i] = w.nodes[i].inode_id;
+        for(int k=0;k<inode_nblock(inode);k++){
+            blocks[nblock++] = inode->block_point[k];
+        }
+        if(inode->file_type==TYPE_DIR){
+            ndir++;
+        }
+    }
+
+    int ret = dir_remove_entry(parent_id,name);
+    if(ret<0){
+        goto out;
+    }
+    if(w.nodes[0].inode.file_type==TYPE_DIR){   // 子目录的 ".." 不再指向父目录
+        add_link(parent_id,-1);
+    }
+    ret = free_inodes_and_blocks(w.count,inodes,nblock,blocks,ndir);
+
+out:
+    free(inodes);
+    free(blocks);
+    walk_free(&w);
+    return ret;
+}
+
+int remove_path(const char *path,int mode){
+    char tmp[DIR_NAME_MAX + 1];
+    int parent_id = find_path_directory(path,tmp);
+    if(parent_id<0){
+        return parent_id;
+    }
+    if(tmp[0]=='\0' || !strcmp(tmp,".") || !strcmp(tmp,"..")){
+        return -EINVAL;
+    }
+    uint8_t type;
+    int inode_id = dir_lookup(parent_id,tmp,&type);
+    if(inode_id<0){
+        return inode_id;
+    }
+    if(mode==REMOVE_FILE && type==TYPE_DIR){
+        return -EISDIR;
+    }
+    if(mode==REMOVE_EMPTY_DIR){
+        if(type!=TYPE_DIR){
+            return -ENOTDIR;
+        }
+        int r = dir_is_empty(inode_id);
+        if(r<0){
+            return r;
+        }
+        if(r==0){
+            return -ENOTEMPTY;
+        }
+    }
+    return remove_tree(parent_id,tmp,inode_id,path);
+}
+
+typedef struct copy_ctx {
+    walk_t *w;
+    uint32_t dst_parent;            // 复制出的根目录的 ".." 指向它
+    uint32_t *ids;                  // ids[i] 为 nodes[i] 的副本的inode号
+    uint32_t *blocks;               // 批量分配到的全部数据块
+    int *first_block;               // nodes[i] 的副本使用 blocks[first_block[i]] 起的 nblock[i] 块
+    int *nblock;
+    int *first_child;               // 子节点链表
+    int *next_sibling;
+    atomic_int error;               // 有任务失败时置1，由各工作线程并发写入
+    tpool_group_t tasks;            // 复制各节点的任务
+} copy_ctx_t;
+
+typedef struct copy_task {
+    copy_ctx_t *ctx;
+    int index;
+} copy_task_t;
+
+/**
+ * @brief 计算目录 nodes[i] 的副本需要的目录块数
+ *        新目录块从头依次填充，与 dir_block_insert 的结果一致
+ */
+static int plan_dir_blocks(copy_ctx_t *ctx,int i){
+    int nblock = 1;
+    int used = DIR_REC_LEN(1) + DIR_REC_LEN(2);     // "." 和 ".."
+    for(int c=ctx->first_child[i];c>=0;c=ctx->next_sibling[c]){
+        int need = DIR_REC_LEN(strlen(ctx->w->nodes[c].name));
+        if(used + need > dir_block_size()){
+            nblock++;
+            used = 0;
+        }
+        used += need;
+    }
+    return nblock;
+}
+
+static void copy_node(void *arg){
+    copy_task_t *t = (copy_task_t*)arg;
+    copy_ctx_t *ctx = t->ctx;
+    walk_node_t *node = &ctx->w->nodes[t->index];
+    uint32_t *blocks = &ctx->blocks[ctx->first_block[t->index]];
+    char buf[BLOCK_SIZE];
+
+    if(node->inode.file_type==TYPE_DIR){
+        int parent = node->parent;
+        int k = 0;
+        dir_block_init(buf);
+        dir_block_insert(buf,".",ctx->ids[t->index],TYPE_DIR);
+        dir_block_insert(buf,"..",parent>=0 ? ctx->ids[parent] : ctx->dst_parent,TYPE_DIR);
+        for(int c=ctx->first_child[t->index];c>=0;c=ctx->next_sibling[c]){
+            walk_node_t *child = &ctx->w->nodes[c];
+            if(dir_block_insert(buf,child->name,ctx->ids[c],child->inode.file_type)==0){
+                continue;
+            }
+            if(store_dir_block(blocks[k++],buf)<0){
+                atomic_store(&ctx->error,1);
+            }
+            dir_block_init(buf);
+            dir_block_insert(buf,child->name,ctx->ids[c],child->inode.file_type);
+        }
+        if(store_dir_block(blocks[k],buf)<0){
+            atomic_store(&ctx->error,1);
+        }
+    } else {
+        for(int k=0;k<ctx->nblock[t->index];k++){
+            if(load_block(node->inode.block_point[k],buf)<0 || store_block(blocks[k],buf)<0){
+                atomic_store(&ctx->error,1);
+            }
+        }
+    }
+    free(t);
+}
+
+int copy_tree(const char *src_path,const char *dst_path){
+    int src_id = find_path(src_path,NULL);
+    if(src_id<0){
+        return src_id;
+    }
+    char tmp[DIR_NAME_MAX + 1];
+    int parent_id = find_path_directory(dst_path,tmp);
+    if(parent_id<0){
+        return parent_id;
+    }
+    if(tmp[0]=='\0'){
+        return -EEXIST;
+    }
+    int r = dir_lookup(parent_id,tmp,NULL);
+    if(r>=0){
+        return -EEXIST;
+    }
+    if(r!=-ENOENT){
+        return r;
+    }
+
+    walk_t w;
+    if(walk_tree(&w,src_id,src_path)<0){
+        walk_free(&w);
+        return -EIO;
+    }
+    int n = w.count;
+    int ret = -ENOMEM;
+    int allocated = 0;
+    int total = 0;
+    int ndir = 0;
+    copy_ctx_t ctx;
+    memset(&ctx,0,sizeof(ctx));
+    ctx.w = &w;
+    ctx.dst_parent = parent_id;
+    atomic_init(&ctx.error,0);
+    tpool_group_init(&ctx.tasks);
+    ctx.ids = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    ctx.first_block = (int*)malloc(sizeof(int) * n);
+    ctx.nblock = (int*)malloc(sizeof(int) * n);
+    ctx.first_child = (int*)malloc(sizeof(int) * n);
+    ctx.next_sibling = (int*)malloc(sizeof(int) * n);
+    inode_t *inodes = (inode_t*)malloc(sizeof(inode_t) * n);
+    if(!ctx.ids || !ctx.first_block || !ctx.nblock || !ctx.first_child || !ctx.next_sibling || !inodes){
+        goto out;
+    }
+
+    // 按父节点把子节点串成链表，逆序插入使链表保持原有顺序
+    for(int i=0;i<n;i++){
+        ctx.first_child[i] = -1;
+        ctx.next_sibling[i] = -1;
+    }
+    for(int i=n-1;i>=1;i--){
+        int p = w.nodes[i].parent;
+        ctx.next_sibling[i] = ctx.first_child[p];
+        ctx.first_child[p] = i;
+    }
+
+    // 先算出总共需要多少块，再一次性分配全部inode和数据块
+    for(int i=0;i<n;i++){
+        if(w.nodes[i].inode.file_type==TYPE_DIR){
+            ctx.nblock[i] = plan_dir_blocks(&ctx,i);
+            if(ctx.nblock[i]>MAX_FILE_BLOCK_NUM){
+                ret = -EFBIG;
+                goto out;
+            }
+            ndir++;
+        } else {
+            ctx.nblock[i] = inode_nblock(&w.nodes[i].inode);
+        }
+        ctx.first_block[i] = total;
+        total += ctx.nblock[i];
+    }
+    ctx.blocks = (uint32_t*)malloc(sizeof(uint32_t) * (total>0 ? total : 1));
+    if(ctx.blocks==NULL){
+        goto out;
+    }
+    ret = alloc_inodes_and_blocks(n,ctx.ids,total,ctx.blocks,ndir);
+    if(ret<0){
+        goto out;
+    }
+    allocated = 1;
+
+    // 各节点的目录块和文件数据互不重叠，并行写入
+    tpool_t *pool = tpool_default();
+    for(int i=0;i<n;i++){
+        copy_task_t *t = (copy_task_t*)malloc(sizeof(copy_task_t));
+        if(t==NULL){
+            atomic_store(&ctx.error,1);
+            break;
+        }
+        t->ctx = &ctx;
+        t->index = i;
+        if(pool==NULL || tpool_submit_group(pool,&ctx.tasks,copy_node,t)<0){   // 线程池不可用时就地执行
+            copy_node(t);
+        }
+    }
+    if(pool){
+        tpool_group_wait(pool,&ctx.tasks);
+    }
+    ret = -EIO;
+    if(atomic_load(&ctx.error)){
+        goto out;
+    }
+
+    // inode 按inode表块合并写回
+    for(int i=0;i<n;i++){
+        inode_t *inode = &inodes[i];
+        *inode = w.nodes[i].inode;
+        memset(inode->block_point,0,sizeof(inode->block_point));
+        for(int k=0;k<ctx.nblock[i];k++){
+            inode->block_point[k] = ctx.blocks[ctx.first_block[i]+k];
+        }
+        if(inode->file_type==TYPE_DIR){
+            inode->size = ctx.nblock[i] * BLOCK_SIZE;
+            inode->link = 2;
+        } else {
+            inode->link = 1;
+        }
+    }
+    for(int i=1;i<n;i++){
+        if(inodes[i].file_type==TYPE_DIR){
+            inodes[w.nodes[i].parent].link++;
+        }
+    }
+    if(store_inodes(ctx.ids,n,inodes)<0){
+        goto out;
+    }
+
+    ret = dir_add_entry(parent_id,tmp,ctx.ids[0],inodes[0].file_type);
+    if(ret<0){
+        goto out;
+    }
+    if(inodes[0].file_type==TYPE_DIR){
+        add_link(parent_id,1);
+    }
+    ret = 0;
+
+out:
+    if(ret<0 && allocated){     // 复制失败，归还已分配的inode和数据块
+        free_inodes_and_blocks(n,ctx.ids,total,ctx.blocks,ndir);
+    }
+    free(ctx.ids);
+    free(ctx.blocks);
+    free(ctx.first_block);
+    free(ctx.nblock);
+    free(ctx.first_child);
+    free(ctx.next_sibling);
+    free(inodes);
+    tpool_group_destroy(&ctx.tasks);
+    walk_free(&w);
+    return ret;
+}
@@ -0,0 +1,295 @@
+#include "walk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct walk_task {
+    walk_t *w;
+    int index;                  // 当前目录在 nodes 中的下标
+    inode_t inode;              // 当前目录的inode
+    char *path;
+} walk_task_t;
+
+typedef struct walk_entry {
+    uint32_t inode_id;
+    char name[DIR_NAME_MAX + 1];
+} walk_entry_t;
+
+static void walk_dir(void *arg);
+
+/**
+ * @brief 在 nodes 末尾预留 n 个位置，调用时需持有 w->lock
+ * @return 成功返回起始下标，失败返回-1
+ */
+static int reserve_nodes(walk_t *w,int n){
+    if(w->count + n > w->cap){
+        int cap = w->cap ? w->cap : 64;
+        while(cap < w->count + n){
+            cap *= 2;
+        }
+        walk_node_t *nodes = (walk_node_t*)realloc(w->nodes,sizeof(walk_node_t) * cap);
+        if(nodes==NULL){
+            return -1;
+        }
+        w->nodes = nodes;
+        w->cap = cap;
+    }
+    int base = w->count;
+    w->count += n;
+    return base;
+}
+
+static char* join_path(const char *dir,const char *name){
+    size_t len = strlen(dir);
+    char *path = (char*)malloc(len + strlen(name) + 2);
+    if(path==NULL){
+        return NULL;
+    }
+    strcpy(path,dir);
+    if(len==0 || dir[len-1]!='/'){
+        path[len++] = '/';
+    }
+    strcpy(path+len,name);
+    return path;
+}
+
+/**
+ * @brief 读出目录中除 "." 和 ".." 外的全部目录项
+ * @return 成功返回目录项个数，失败返回-1
+ */
+static int read_entries(inode_t *dir,walk_entry_t **out){
+    char buf[BLOCK_SIZE];
+    int n = 0;
+    int cap = 16;
+    walk_entry_t *entries = (walk_entry_t*)malloc(sizeof(walk_entry_t) * cap);
+    if(entries==NULL){
+        return -1;
+    }
+    for(int k=0;k<inode_nblock(dir);k++){
+        if(load_dir_block(dir->block_point[k],buf)<0){
+            free(entries);
+            return -1;
+        }
+        uint32_t off = 0;
+        while(off<(uint32_t)dir_block_size()){
+            dir_item_t *item = (dir_item_t*)(buf+off);
+            if(item->rec_len==0){
+                break;
+            }
+            off += item->rec_len;
+            if(item->name_len==0
+                || (item->name_len==1 && item->name[0]=='.')
+                || (item->name_len==2 && item->name[0]=='.' && item->name[1]=='.')){
+                continue;
+            }
+            if(n==cap){
+                cap *= 2;
+                walk_entry_t *tmp = (walk_entry_t*)realloc(entries,sizeof(walk_entry_t) * cap);
+                if(tmp==NULL){
+                    free(entries);
+                    return -1;
+                }
+                entries = tmp;
+            }
+            entries[n].inode_id = item->inode_id;
+            memcpy(entries[n].name,item->name,item->name_len);
+            entries[n].name[item->name_len] = '\0';
+            n++;
+        }
+    }
+    *out = entries;
+    return n;
+}
+
+static void fail(walk_t *w){
+    pthread_mutex_lock(&w->lock);
+    w->error = 1;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void walk_dir(void *arg){
+    walk_task_t *t = (walk_task_t*)arg;
+    walk_t *w = t->w;
+    walk_entry_t *entries = NULL;
+    uint32_t *ids = NULL;
+    inode_t *inodes = NULL;
+    char **paths = NULL;
+
+    int n = read_entries(&t->inode,&entries);
+    if(n<0){
+        fail(w);
+        free(t);
+        return;
+    }
+    if(n==0){
+        free(entries);
+        free(t);
+        return;
+    }
+
+    ids = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    inodes = (inode_t*)malloc(sizeof(inode_t) * n);
+    paths = (char**)calloc(n,sizeof(char*));
+    if(ids==NULL || inodes==NULL || paths==NULL){
+        fail(w);
+        goto out;
+    }
+    for(int i=0;i<n;i++){
+        ids[i] = entries[i].inode_id;
+        paths[i] = join_path(t->path,entries[i].name);
+        if(paths[i]==NULL){
+            fail(w);
+            goto out;
+        }
+    }
+    // 同一inode表块中的子项只读一次
+    if(load_inodes(ids,n,inodes)<0){
+        fail(w);
+        goto out;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    int base = reserve_nodes(w,n);
+    if(base>=0){
+        for(int i=0;i<n;i++){
+            walk_node_t *node = &w->nodes[base+i];
+            node->inode_id = ids[i];
+            node->parent = t->index;
+            node->inode = inodes[i];
+            node->path = paths[i];
+            node->name = strrchr(paths[i],'/') + 1;
+            paths[i] = NULL;    // 所有权交给 nodes
+        }
+    } else {
+        w->error = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if(base<0){
+        goto out;
+    }
+
+    for(int i=0;i<n;i++){
+        if(inodes[i].file_type!=TYPE_DIR){
+            continue;
+        }
+        walk_task_t *sub = (walk_task_t*)malloc(sizeof(walk_task_t));
+        if(sub==NULL){
+            fail(w);
+            continue;
+        }
+        sub->w = w;
+        sub->index = base + i;
+        sub->inode = inodes[i];
+        pthread_mutex_lock(&w->lock);
+        sub->path = w->nodes[base+i].path;
+        pthread_mutex_unlock(&w->lock);
+        if(tpool_submit_group(tpool_default(),&w->tasks,walk_dir,sub)<0){
+            free(sub);
+            fail(w);
+        }
+    }
+
+out:
+    if(paths){
+        for(int i=0;i<n;i++){
+            free(paths[i]);
+        }
+    }
+    free(paths);
+    free(inodes);
+    free(ids);
+    free(entries);
+    free(t);
+}
+
+int walk_tree(walk_t *w,uint32_t inode_id,const char *path){
+    memset(w,0,sizeof(walk_t));
+    pthread_mutex_init(&w->lock,NULL);
+    tpool_group_init(&w->tasks);
+
+    inode_t inode;
+    if(load_inodes(&inode_id,1,&inode)<0){
+        return -1;
+    }
+    // 去掉路径末尾多余的'/'，但保留根目录的 "/"
+    char *root_path = strdup(path);
+    if(root_path==NULL){
+        return -1;
+    }
+    size_t len = strlen(root_path);
+    while(len>1 && root_path[len-1]=='/'){
+        root_path[--len] = '\0';
+    }
+
+    reserve_nodes(w,1);
+    if(w->nodes==NULL){
+        free(root_path);
+        return -1;
+    }
+    w->nodes[0].inode_id = inode_id;
+    w->nodes[0].parent = -1;
+    w->nodes[0].inode = inode;
+    w->nodes[0].path = root_path;
+    char *slash = strrchr(root_path,'/');
+    w->nodes[0].name = (slash && slash[1]) ? slash+1 : root_path;
+
+    if(inode.file_type==TYPE_DIR){     // 根为文件时不需要线程池
+        tpool_t *pool = tpool_default();
+        walk_task_t *t = (walk_task_t*)malloc(sizeof(walk_task_t));
+        if(pool==NULL || t==NULL){
+            free(t);
+            return -1;
+        }
+        t->w = w;
+        t->index = 0;
+        t->inode = inode;
+        t->path = root_path;
+        if(tpool_submit_group(pool,&w->tasks,walk_dir,t)<0){
+            free(t);
+            return -1;
+        }
+        tpool_group_wait(pool,&w->tasks);
+    }
+    return w->error ? -1 : 0;
+}
+
+void walk_free(walk_t *w){
+    for(int i=0;i<w->count;i++){
+        free(w->nodes[i].path);
+    }
+    free(w->nodes);
+    pthread_mutex_destroy(&w->lock);
+    tpool_group_destroy(&w->tasks);
+    memset(w,0,sizeof(walk_t));
+}
+
+typedef struct sort_key {
+    const char *path;
+    int index;
+} sort_key_t;
+
+static int cmp_path(const void *a,const void *b){
+    return strcmp(((const sort_key_t*)a)->path,((const sort_key_t*)b)->path);
+}
+
+int* walk_sorted(walk_t *w){
+    // 排序的键自带路径，比较函数不依赖全局变量，多个线程可以同时排序各自的遍历结果
+    int n = w->count>0 ? w->count : 1;
+    int *order = (int*)malloc(sizeof(int) * n);
+    sort_key_t *keys = (sort_key_t*)malloc(sizeof(sort_key_t) * n);
+    if(order==NULL || keys==NULL){
+        free(order);
+        free(keys);
+        return NULL;
+    }
+    for(int i=0;i<w->count;i++){
+        keys[i].path = w->nodes[i].path;
+        keys[i].index = i;
+    }
+    qsort(keys,w->count,sizeof(sort_key_t),cmp_path);
+    for(int i=0;i<w->count;i++){
+        order[i] = keys[i].index;
+    }
+    free(keys);
+    return order;
+}
@@ -0,0 +1,237 @@
+#include "disk.h"
+#include "wback.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// The dirty blocks, in no particular order, and a hash of block number to
+// index in list. The hash has twice as many slots as there can be dirty
+// blocks, so probes stay short however large the disk is.
+#define NSLOT (WBACK_MAX_DIRTY * 2)
+
+typedef struct dirty_block {
+        unsigned int block_num;
+        char* buf;              // buffered content
+} dirty_block_t;
+
+static dirty_block_t* list;
+static int* slots;              // index in list + 1, or 0 for an empty slot
+static unsigned int ndirty;
+static unsigned int nblocks;
+static unsigned int align;
+static wback_write_fn write_run;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int running;
+static int stopping;
+
+static unsigned int slot_of(unsigned int block_num)
+{
+        unsigned int i = (block_num * 2654435761u) & (NSLOT - 1);
+        while(slots[i] != 0 && list[slots[i] - 1].block_num != block_num){
+                i = (i + 1) & (NSLOT - 1);
+        }
+        return i;
+}
+
+// Called with lock held, after list was reordered or shrunk.
+static void rehash()
+{
+        memset(slots, 0, sizeof(int) * NSLOT);
+        for(unsigned int i = 0; i < ndirty; i++){
+                slots[slot_of(list[i].block_num)] = i + 1;
+        }
+}
+
+static dirty_block_t* find_dirty(unsigned int block_num)
+{
+        int i = slots[slot_of(block_num)];
+        return i ? &list[i - 1] : NULL;
+}
+
+static int cmp_block(const void* a, const void* b)
+{
+        unsigned int x = ((const dirty_block_t*)a)->block_num;
+        unsigned int y = ((const dirty_block_t*)b)->block_num;
+        return x < y ? -1 : (x > y);
+}
+
+// Called with lock held.
+static int flush_locked()
+{
+        struct iovec iov[IOV_MAX];
+        unsigned int kept = 0;
+        int r = 0;
+        qsort(list, ndirty, sizeof(dirty_block_t), cmp_block);
+        unsigned int i = 0;
+        while(i < ndirty){
+                unsigned int j = i;
+                while(j < ndirty && j - i < IOV_MAX && list[j].block_num == list[i].block_num + (j - i)){
+                        iov[j - i].iov_base = list[j].buf;
+                        iov[j - i].iov_len = DEVICE_BLOCK_SIZE;
+                        j++;
+                }
+                if(write_run(list[i].block_num, iov, j - i) < 0){
+                        r = -1;
+                        while(i < j){
+                                list[kept++] = list[i++];
+                        }
+                        continue;
+                }
+                for(; i < j; i++){
+                        free(list[i].buf);
+                }
+        }
+        ndirty = kept;
+        rehash();
+        return r;
+}
+
+static void* flush_loop(void* arg)
+{
+        (void)arg;
+        pthread_mutex_lock(&lock);
+        while(!stopping){
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += (long)WBACK_INTERVAL_MS * 1000000;
+                ts.tv_sec += ts.tv_nsec / 1000000000;
+                ts.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&wake, &lock, &ts);
+                if(ndirty > 0){
+                        flush_locked();
+                }
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+}
+
+int wback_init(unsigned int n, unsigned int a, wback_write_fn fn)
+{
+        wback_destroy();
+        list = (dirty_block_t*)malloc(sizeof(dirty_block_t) * WBACK_MAX_DIRTY);
+        slots = (int*)calloc(NSLOT, sizeof(int));
+        if(list == NULL || slots == NULL){
+                free(list);
+                free(slots);
+                list = NULL;
+                slots = NULL;
+                return -1;
+        }
+        nblocks = n;
+        ndirty = 0;
+        align = a;
+        write_run = fn;
+        stopping = 0;
+        if(pthread_create(&flusher, NULL, flush_loop, NULL) != 0){
+                free(list);
+                free(slots);
+                list = NULL;
+                slots = NULL;
+                return -1;
+        }
+        running = 1;
+        return 0;
+}
+
+int wback_destroy()
+{
+        if(!running){
+                return 0;
+        }
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+        pthread_join(flusher, NULL);
+        running = 0;
+
+        int r = ndirty > 0 ? flush_locked() : 0;
+        for(unsigned int i = 0; i < ndirty; i++){
+                free(list[i].buf);
+        }
+        free(list);
+        free(slots);
+        list = NULL;
+        slots = NULL;
+        ndirty = 0;
+        nblocks = 0;
+        return r;
+}
+
+int wback_lookup(unsigned int block_num, char* buf)
+{
+        int r = -1;
+        pthread_mutex_lock(&lock);
+        if(ndirty > 0 && block_num < nblocks){
+                dirty_block_t* d = find_dirty(block_num);
+                if(d != NULL){
+                        memcpy(buf, d->buf, DEVICE_BLOCK_SIZE);
+                        r = 0;
+                }
+        }
+        pthread_mutex_unlock(&lock);
+        return r;
+}
+
+int wback_add(unsigned int block_num, const char* buf)
+{
+        if(!running || block_num >= nblocks){
+                return -1;
+        }
+        pthread_mutex_lock(&lock);
+        dirty_block_t* d = find_dirty(block_num);
+        if(d == NULL){
+                if(ndirty == WBACK_MAX_DIRTY && flush_locked() < 0 && ndirty == WBACK_MAX_DIRTY){
+                        pthread_mutex_unlock(&lock);
+                        return -1;
+                }
+                char* b;
+                if(posix_memalign((void**)&b, align, DEVICE_BLOCK_SIZE) != 0){
+                        pthread_mutex_unlock(&lock);
+                        return -1;
+                }
+                d = &list[ndirty++];
+                d->block_num = block_num;
+                d->buf = b;
+                slots[slot_of(block_num)] = ndirty;
+        }
+        memcpy(d->buf, buf, DEVICE_BLOCK_SIZE);
+        pthread_mutex_unlock(&lock);
+        return 0;
+}
+
+void wback_drop(unsigned int block_num, unsigned int count)
+{
+        pthread_mutex_lock(&lock);
+        unsigned int kept = 0;
+        for(unsigned int i = 0; i < ndirty; i++){
+                unsigned int b = list[i].block_num;
+                if(b >= block_num && b - block_num < count){
+                        free(list[i].buf);
+                } else {
+                        list[kept++] = list[i];
+                }
+        }
+        if(kept != ndirty){
+                ndirty = kept;
+                rehash();
+        }
+        pthread_mutex_unlock(&lock);
+}
+
+int wback_flush()
+{
+        pthread_mutex_lock(&lock);
+        int r = ndirty > 0 ? flush_locked() : 0;
+        pthread_mutex_unlock(&lock);
+        return r;
+}